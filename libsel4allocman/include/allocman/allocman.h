@@ -93,6 +93,58 @@ struct allocman_freed_utspace_chunk {
     seL4_Word cookie;
 };
 
+struct allocman_watermark_stats {
+    /* allocations served from each reserve */
+    size_t cspace_used;
+    size_t mspace_used;
+    size_t utspace_used;
+    /* refills that put resources back into the reserves */
+    size_t refills;
+    /* resources put back in total, and the most in a single refill */
+    size_t refilled;
+    size_t max_refilled;
+    /* time spent refilling in total, and the longest single refill. Only
+     * counted if a clock is configured, in its units */
+    uint64_t refill_time;
+    uint64_t max_refill_time;
+};
+
+#define ALLOCMAN_STATS_BUCKETS seL4_WordBits
+
+/* Statistics of one of the allocators of an allocman. Only counts calls into the allocator,
+ * not allocations served from the reserves */
+struct allocman_space_stats {
+    size_t allocs;
+    size_t failed_allocs;
+    size_t frees;
+    /* outstanding allocations, and the most there have been */
+    size_t live;
+    size_t max_live;
+    /* deepest recursion into the alloc and free functions */
+    size_t max_alloc_depth;
+    size_t max_free_depth;
+    /* time spent in the allocator, including any nested allocations it made. Only counted
+     * if a clock is configured */
+    uint64_t alloc_time;
+    uint64_t free_time;
+};
+
+struct allocman_stats {
+    struct allocman_space_stats cspace;
+    struct allocman_space_stats mspace;
+    struct allocman_space_stats utspace;
+    /* outstanding bytes, and the most there have been */
+    size_t mspace_bytes;
+    size_t max_mspace_bytes;
+    size_t utspace_bytes;
+    size_t max_utspace_bytes;
+    /* mspace allocations by size rounded up to a power of 2, indexed by its log2 */
+    size_t mspace_sizes[ALLOCMAN_STATS_BUCKETS];
+    /* utspace allocations by size_bits and by object type */
+    size_t utspace_sizes[ALLOCMAN_STATS_BUCKETS];
+    size_t utspace_types[seL4_ObjectTypeCount];
+};
+
 /**
  * The allocman itself. This is generally the only type you will need to pass around
  * to deal with allocation. It is declared in full here so that the compiler is able
@@ -123,6 +175,19 @@ typedef struct allocman {
     int refilling_watermark;
     /* Has a watermark resource been used. This is just an optimization */
     int used_watermark;
+    /* Maximum number of resources refilled at the end of each operation, 0 for no limit */
+    size_t refill_budget;
+    /* Number of entries each reserve is refilled to regardless of the budget */
+    size_t refill_minimum;
+    struct allocman_watermark_stats watermark_stats;
+
+    /* Optional clock used to time operations for statistics */
+    uint64_t (*clock)(void *cookie);
+    void *clock_cookie;
+
+    /* Whether allocation statistics are collected, see allocman_configure_stats */
+    int stats_enabled;
+    struct allocman_stats stats;
 
     /* track resources that we have not yet been able to free due to circular dependencies */
     size_t desired_freed_slots;
@@ -153,6 +218,11 @@ typedef struct allocman {
     struct allocman_utspace_chunk *utspace_chunk;
     size_t *utspace_chunk_count;
     struct allocman_utspace_allocation **utspace_chunks;
+
+    /* device untypeds whose adding to the utspace has been deferred until an allocation
+     * may need them, and the function that adds them */
+    void *pending_device_uts;
+    void (*add_pending_device_uts)(struct allocman *alloc, void *pending);
 } allocman_t;
 
 /**
@@ -212,6 +282,15 @@ static inline cspacepath_t allocman_cspace_make_path(allocman_t *alloc, seL4_CPt
     return alloc->cspace.make_path(alloc->cspace.cspace, slot);
 }
 
+/**
+ * Add any device untypeds that were registered lazily to the utspace. This happens
+ * automatically on the first allocation that can be served from device untypeds, but
+ * may be called earlier to take the cost at a convenient time.
+ *
+ * @param alloc Allocman to add the untypeds to
+ */
+void allocman_add_pending_device_uts(allocman_t *alloc);
+
 /**
  * Allocates a portion of untyped memory, and retypes it into the desired object for you.
  *
@@ -356,6 +435,71 @@ int allocman_configure_max_freed_slots(allocman_t *alloc, size_t num);
  */
 int allocman_configure_max_freed_memory_chunks(allocman_t *alloc, size_t num);
 
+/**
+ * Limit how much refilling of the reserves is done at the end of each operation. By default
+ * the reserves are refilled completely by the operation that used them, which makes its
+ * latency spike. With a budget the refilling is spread over following operations instead.
+ *
+ * Regardless of the budget, every reserve is still refilled to at least minimum entries (or
+ * its configured size, if smaller), and an empty reserve always gets at least one. Recursive
+ * allocations are only guaranteed to succeed if none of them needs more than minimum entries
+ * of a reserve, so minimum should be the most any single allocation can take from a reserve.
+ * allocman_fill_reserves is not limited.
+ *
+ * @param alloc The allocman to configure
+ * @param budget Maximum number of resources to refill per operation, 0 for no limit
+ * @param minimum Number of entries each reserve is refilled to regardless of the budget
+ */
+void allocman_configure_refill_budget(allocman_t *alloc, size_t budget, size_t minimum);
+
+/**
+ * Configure a clock used to time operations in the allocman statistics. Without one no
+ * times are recorded.
+ *
+ * @param alloc The allocman to configure
+ * @param clock Function returning the current time in any unit, NULL to disable timing
+ * @param cookie Passed to clock
+ */
+void allocman_configure_clock(allocman_t *alloc, uint64_t (*clock)(void *cookie), void *cookie);
+
+/**
+ * @return statistics about the use and refilling of the reserves of an allocman
+ */
+struct allocman_watermark_stats allocman_get_watermark_stats(allocman_t *alloc);
+
+/**
+ * Start or stop collecting allocation statistics. Collection is off by default. Outstanding
+ * allocation counts are only accurate for allocations made while collection was on.
+ *
+ * @param alloc The allocman to configure
+ * @param enable Whether to collect statistics
+ */
+void allocman_configure_stats(allocman_t *alloc, bool enable);
+
+/**
+ * Copy the allocation statistics of an allocman.
+ *
+ * @param alloc The allocman to query
+ * @param stats Filled in with the statistics
+ */
+void allocman_get_stats(allocman_t *alloc, struct allocman_stats *stats);
+
+/**
+ * Reset the cumulative allocation statistics. Outstanding allocations and bytes are kept and
+ * become the new high-water marks.
+ *
+ * @param alloc The allocman to reset
+ */
+void allocman_reset_stats(allocman_t *alloc);
+
+/**
+ * Print the allocation and reserve statistics of an allocman, one line per allocator and
+ * histogram. Histograms only list their non-empty buckets as index:count.
+ *
+ * @param alloc The allocman to print
+ */
+void allocman_print_stats(allocman_t *alloc);
+
 /**
  * Configure the maximul number of freed untyped objects we can store. This is required for
  * scenarios where an allocator cannot handle a recursive call, but we would like to not
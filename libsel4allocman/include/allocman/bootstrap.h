@@ -155,6 +155,15 @@ int allocman_add_simple_untypeds(allocman_t *alloc, simple_t *simple);
  */
 int allocman_add_simple_untypeds_with_regions(allocman_t *alloc, simple_t *simple, int num_regions, pmem_region_t *region_list);
 
+/**
+ * As allocman_add_simple_untypeds_with_regions, except that device untypeds that overlap
+ * PMEM_TYPE_RAM regions are not split until the first allocation that can be served from
+ * device untypeds, or an explicit call to allocman_add_pending_device_uts. All other
+ * untypeds are added immediately, so the time until the first kernel memory allocation
+ * doesn't depend on how fragmented the device memory is. The region list is copied.
+ */
+int allocman_add_simple_untypeds_lazy(allocman_t *alloc, simple_t *simple, int num_regions, pmem_region_t *region_list);
+
 /**
  * Bootstraps using all the information provided by simple, but switches to a new two
  * level cspace. All capabilities specified by simple will be moved to the new cspace. All untypeds specified by simple are given to the allocator
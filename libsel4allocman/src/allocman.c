@@ -9,11 +9,13 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
 #include <sel4/sel4.h>
 #include <vka/capops.h>
 #include <sel4utils/util.h>
 
-static int _refill_watermark(allocman_t *alloc);
+static int _refill_watermark(allocman_t *alloc, size_t budget);
 
 static inline int _can_alloc(struct allocman_properties properties, size_t alloc_depth, size_t free_depth)
 {
@@ -44,7 +46,7 @@ static inline void _end_operation(allocman_t *alloc, int root)
     /* Anytime we end an operation we need to make sure we have watermark
        resources */
     if (root) {
-        _refill_watermark(alloc);
+        _refill_watermark(alloc, alloc->refill_budget);
     }
 }
 
@@ -90,6 +92,51 @@ static void allocman_utspace_queue_for_free(allocman_t *alloc, seL4_Word cookie,
     alloc->num_freed_utspace_chunks++;
 }
 
+static inline uint64_t _stats_now(allocman_t *alloc)
+{
+    return (alloc->stats_enabled && alloc->clock) ? alloc->clock(alloc->clock_cookie) : 0;
+}
+
+static void _stats_alloc(allocman_t *alloc, struct allocman_space_stats *stats, size_t depth, int error,
+                         uint64_t start)
+{
+    if (!alloc->stats_enabled) {
+        return;
+    }
+    stats->max_alloc_depth = MAX(stats->max_alloc_depth, depth);
+    if (alloc->clock) {
+        stats->alloc_time += alloc->clock(alloc->clock_cookie) - start;
+    }
+    if (error) {
+        stats->failed_allocs++;
+        return;
+    }
+    stats->allocs++;
+    stats->live++;
+    stats->max_live = MAX(stats->max_live, stats->live);
+}
+
+static void _stats_free(allocman_t *alloc, struct allocman_space_stats *stats, size_t depth, uint64_t start)
+{
+    if (!alloc->stats_enabled) {
+        return;
+    }
+    stats->max_free_depth = MAX(stats->max_free_depth, depth);
+    if (alloc->clock) {
+        stats->free_time += alloc->clock(alloc->clock_cookie) - start;
+    }
+    stats->frees++;
+    /* allocations made before collection started are not counted as live */
+    stats->live -= MIN(stats->live, 1);
+}
+
+/* log2 of size rounded up to a power of 2 */
+static inline size_t _stats_size_bucket(size_t size)
+{
+    size_t bits = size <= 1 ? 0 : seL4_WordBits - CLZL((long)(size - 1));
+    return MIN(bits, ALLOCMAN_STATS_BUCKETS - 1);
+}
+
 /* this nasty macro prevents code duplication for the free functions. Unfortunately I can think of no other
  * way of allowing the number of arguments to the 'free' function in the body to be parameterized */
 #define ALLOCMAN_FREE(alloc,space,...) do { \
@@ -100,8 +147,10 @@ static void allocman_utspace_queue_for_free(allocman_t *alloc, seL4_Word cookie,
         return; \
     } \
     root = _start_operation(alloc); \
+    uint64_t start = _stats_now(alloc); \
     alloc->space##_free_depth++; \
     alloc->space.free(alloc, alloc->space.space, __VA_ARGS__); \
+    _stats_free(alloc, &alloc->stats.space, alloc->space##_free_depth, start); \
     alloc->space##_free_depth--; \
     _end_operation(alloc, root); \
 } while(0)
@@ -114,11 +163,17 @@ void allocman_cspace_free(allocman_t *alloc, const cspacepath_t *slot)
 void allocman_mspace_free(allocman_t *alloc, void *ptr, size_t bytes)
 {
     ALLOCMAN_FREE(alloc, mspace, ptr, bytes);
+    if (alloc->stats_enabled) {
+        alloc->stats.mspace_bytes -= MIN(alloc->stats.mspace_bytes, bytes);
+    }
 }
 
 void allocman_utspace_free(allocman_t *alloc, seL4_Word cookie, size_t size_bits)
 {
     ALLOCMAN_FREE(alloc, utspace, cookie, size_bits);
+    if (alloc->stats_enabled) {
+        alloc->stats.utspace_bytes -= MIN(alloc->stats.utspace_bytes, BIT(size_bits));
+    }
 }
 
 static void *_try_watermark_mspace(allocman_t *alloc, size_t size, int *_error)
@@ -130,6 +185,7 @@ static void *_try_watermark_mspace(allocman_t *alloc, size_t size, int *_error)
                 void *ret = alloc->mspace_chunks[i][--alloc->mspace_chunk_count[i]];
                 SET_ERROR(_error, 0);
                 alloc->used_watermark = 1;
+                alloc->watermark_stats.mspace_used++;
                 return ret;
             }
         }
@@ -144,6 +200,7 @@ static int _try_watermark_cspace(allocman_t *alloc, cspacepath_t *slot)
         return 1;
     }
     alloc->used_watermark = 1;
+    alloc->watermark_stats.cspace_used++;
     *slot = alloc->cspace_slots[--alloc->num_cspace_slots];
     return 0;
 }
@@ -165,6 +222,7 @@ static seL4_Word _try_watermark_utspace(allocman_t *alloc, size_t size_bits, seL
                     return 0;
                 }
                 alloc->used_watermark = 1;
+                alloc->watermark_stats.utspace_used++;
                 alloc->utspace_chunk_count[i]--;
                 allocman_cspace_free(alloc, &result.slot);
                 SET_ERROR(_error, 0);
@@ -201,9 +259,16 @@ static void *_allocman_mspace_alloc(allocman_t *alloc, size_t size, int *_error,
     }
     root_op = _start_operation(alloc);
     /* Attempt the allocation */
+    uint64_t start = _stats_now(alloc);
     alloc->mspace_alloc_depth++;
     ret = alloc->mspace.alloc(alloc, alloc->mspace.mspace, size, &error);
+    _stats_alloc(alloc, &alloc->stats.mspace, alloc->mspace_alloc_depth, error, start);
     alloc->mspace_alloc_depth--;
+    if (!error && alloc->stats_enabled) {
+        alloc->stats.mspace_bytes += size;
+        alloc->stats.max_mspace_bytes = MAX(alloc->stats.max_mspace_bytes, alloc->stats.mspace_bytes);
+        alloc->stats.mspace_sizes[_stats_size_bucket(size)]++;
+    }
     if (!error) {
         _end_operation(alloc, root_op);
         SET_ERROR(_error, 0);
@@ -247,8 +312,10 @@ static int _allocman_cspace_alloc(allocman_t *alloc, cspacepath_t *slot, int use
     }
     root_op = _start_operation(alloc);
     /* Attempt the allocation */
+    uint64_t start = _stats_now(alloc);
     alloc->cspace_alloc_depth++;
     error = alloc->cspace.alloc(alloc, alloc->cspace.cspace, slot);
+    _stats_alloc(alloc, &alloc->stats.cspace, alloc->cspace_alloc_depth, error, start);
     alloc->cspace_alloc_depth--;
     if (!error) {
         _end_operation(alloc, root_op);
@@ -280,6 +347,10 @@ static seL4_Word _allocman_utspace_alloc(allocman_t *alloc, size_t size_bits, se
         SET_ERROR(_error, 1);
         return 0;
     }
+    /* adding device untypeds allocates, so only do it when this is not a recursive call */
+    if (alloc->pending_device_uts && !alloc->in_operation && (canBeDev || paddr != ALLOCMAN_NO_PADDR)) {
+        allocman_add_pending_device_uts(alloc);
+    }
     /* Check that we are permitted to utspace_alloc here */
     if (!_can_alloc(alloc->utspace.properties, alloc->utspace_alloc_depth, alloc->utspace_free_depth)) {
         if (use_watermark && paddr == ALLOCMAN_NO_PADDR) {
@@ -295,9 +366,19 @@ static seL4_Word _allocman_utspace_alloc(allocman_t *alloc, size_t size_bits, se
     }
     root_op = _start_operation(alloc);
     /* Attempt the allocation */
+    uint64_t start = _stats_now(alloc);
     alloc->utspace_alloc_depth++;
     ret = alloc->utspace.alloc(alloc, alloc->utspace.utspace, size_bits, type, path, paddr, canBeDev, &error);
+    _stats_alloc(alloc, &alloc->stats.utspace, alloc->utspace_alloc_depth, error, start);
     alloc->utspace_alloc_depth--;
+    if (!error && alloc->stats_enabled) {
+        alloc->stats.utspace_bytes += BIT(size_bits);
+        alloc->stats.max_utspace_bytes = MAX(alloc->stats.max_utspace_bytes, alloc->stats.utspace_bytes);
+        alloc->stats.utspace_sizes[MIN(size_bits, ALLOCMAN_STATS_BUCKETS - 1)]++;
+        if (type < seL4_ObjectTypeCount) {
+            alloc->stats.utspace_types[type]++;
+        }
+    }
     if (!error) {
         _end_operation(alloc, root_op);
         SET_ERROR(_error, error);
@@ -329,21 +410,50 @@ int allocman_cspace_alloc(allocman_t *alloc, cspacepath_t *slot)
     return _allocman_cspace_alloc(alloc, slot, 1);
 }
 
+void allocman_add_pending_device_uts(allocman_t *alloc)
+{
+    void *pending = alloc->pending_device_uts;
+    if (pending == NULL) {
+        return;
+    }
+    alloc->pending_device_uts = NULL;
+    alloc->add_pending_device_uts(alloc, pending);
+}
+
 seL4_Word allocman_utspace_alloc_at(allocman_t *alloc, size_t size_bits, seL4_Word type, const cspacepath_t *path,
                                     uintptr_t paddr, bool canBeDev, int *_error)
 {
     return _allocman_utspace_alloc(alloc, size_bits, type, path, paddr, canBeDev, _error, 1);
 }
 
-static int _refill_watermark(allocman_t *alloc)
+/* Whether a reserve holding count resources may be refilled after refilled resources have
+ * already been refilled in this call. An empty reserve, or one below the minimum, is always
+ * refilled, as recursive allocations may depend on it. */
+static inline int _can_refill(allocman_t *alloc, size_t budget, size_t refilled, size_t count)
+{
+    return budget == 0 || refilled < budget || count == 0 || count < alloc->refill_minimum;
+}
+
+/* Whether a reserve holding count of its desired resources is still short of the refill minimum */
+static inline int _below_minimum(allocman_t *alloc, size_t count, size_t desired)
+{
+    return count < MIN(alloc->refill_minimum, desired);
+}
+
+static int _refill_watermark(allocman_t *alloc, size_t budget)
 {
     int found_empty_pool;
     int did_allocation;
+    size_t refilled = 0;
+    uint64_t start = 0;
     size_t i;
     if (alloc->refilling_watermark || !alloc->used_watermark) {
         return 0;
     }
     alloc->refilling_watermark = 1;
+    if (alloc->clock) {
+        start = alloc->clock(alloc->clock_cookie);
+    }
 
     /* Run in a loop refilling our resources. We need a loop as refilling
        one resource may require another watermark resource to be used. It is up
@@ -354,11 +464,17 @@ static int _refill_watermark(allocman_t *alloc)
        across all the resources types since typically we are only refilling
        a single object from each resource anyway, so the performance will be
        the same, and if we aren't we are boot strapping and I'm not convinced
-       that all allocations orders are equivalent in this case */
+       that all allocations orders are equivalent in this case.
+       If a budget is given at most that many resources are refilled, unless a
+       reserve is below the refill minimum, and the rest is left to following operations.
+       Reserves below the minimum keep being refilled past the usual limit of rounds for
+       as long as progress is made */
     int limit = 0;
+    int below_minimum;
     do {
         found_empty_pool = 0;
         did_allocation = 0;
+        below_minimum = 0;
         while (alloc->num_freed_slots > 0) {
             cspacepath_t slot = alloc->freed_slots[--alloc->num_freed_slots];
             allocman_cspace_free(alloc, &slot);
@@ -379,19 +495,26 @@ static int _refill_watermark(allocman_t *alloc)
             int error;
             found_empty_pool = 1;
             cspacepath_t slot;
-            error = _allocman_cspace_alloc(alloc, &slot, 0);
-            if (!error) {
-                alloc->cspace_slots[alloc->num_cspace_slots++] = slot;
-                did_allocation = 1;
+            if (_can_refill(alloc, budget, refilled, alloc->num_cspace_slots)) {
+                error = _allocman_cspace_alloc(alloc, &slot, 0);
+                if (!error) {
+                    alloc->cspace_slots[alloc->num_cspace_slots++] = slot;
+                    did_allocation = 1;
+                    refilled++;
+                }
             }
+            below_minimum |= _below_minimum(alloc, alloc->num_cspace_slots, alloc->desired_cspace_slots);
         }
         for (i = 0; i < alloc->num_utspace_chunks; i++) {
             if (alloc->utspace_chunk_count[i] < alloc->utspace_chunk[i].count) {
                 cspacepath_t slot;
                 seL4_Word cookie;
                 int error;
-                /* First grab a slot */
                 found_empty_pool = 1;
+                if (!_can_refill(alloc, budget, refilled, alloc->utspace_chunk_count[i])) {
+                    continue;
+                }
+                /* First grab a slot */
                 error = allocman_cspace_alloc(alloc, &slot);
                 if (!error) {
                     /* Now try to allocate */
@@ -402,11 +525,13 @@ static int _refill_watermark(allocman_t *alloc)
                         alloc->utspace_chunks[i][alloc->utspace_chunk_count[i]].slot = slot;
                         alloc->utspace_chunk_count[i]++;
                         did_allocation = 1;
+                        refilled++;
                     } else {
                         /* Give the slot back */
                         allocman_cspace_free(alloc, &slot);
                     }
                 }
+                below_minimum |= _below_minimum(alloc, alloc->utspace_chunk_count[i], alloc->utspace_chunk[i].count);
             }
         }
         for (i = 0 ; i < alloc->num_mspace_chunks; i++) {
@@ -414,23 +539,127 @@ static int _refill_watermark(allocman_t *alloc)
                 void *result;
                 int error;
                 found_empty_pool = 1;
+                if (!_can_refill(alloc, budget, refilled, alloc->mspace_chunk_count[i])) {
+                    continue;
+                }
                 result = _allocman_mspace_alloc(alloc, alloc->mspace_chunk[i].size, &error, 0);
                 if (!error) {
                     alloc->mspace_chunks[i][alloc->mspace_chunk_count[i]++] = result;
                     did_allocation = 1;
+                    refilled++;
                 }
+                below_minimum |= _below_minimum(alloc, alloc->mspace_chunk_count[i], alloc->mspace_chunk[i].count);
             }
         }
         limit++;
-    } while (found_empty_pool && did_allocation && limit < 4);
+    } while (found_empty_pool && did_allocation && (limit < 4 || below_minimum));
 
     alloc->refilling_watermark = 0;
     if (!found_empty_pool) {
         alloc->used_watermark = 0;
     }
+
+    if (refilled > 0) {
+        struct allocman_watermark_stats *stats = &alloc->watermark_stats;
+        stats->refills++;
+        stats->refilled += refilled;
+        stats->max_refilled = MAX(stats->max_refilled, refilled);
+        if (alloc->clock) {
+            uint64_t time = alloc->clock(alloc->clock_cookie) - start;
+            stats->refill_time += time;
+            stats->max_refill_time = MAX(stats->max_refill_time, time);
+        }
+    }
     return found_empty_pool;
 }
 
+void allocman_configure_refill_budget(allocman_t *alloc, size_t budget, size_t minimum)
+{
+    alloc->refill_budget = budget;
+    alloc->refill_minimum = minimum;
+}
+
+void allocman_configure_clock(allocman_t *alloc, uint64_t (*clock)(void *cookie), void *cookie)
+{
+    alloc->clock = clock;
+    alloc->clock_cookie = cookie;
+}
+
+struct allocman_watermark_stats allocman_get_watermark_stats(allocman_t *alloc)
+{
+    return alloc->watermark_stats;
+}
+
+void allocman_configure_stats(allocman_t *alloc, bool enable)
+{
+    alloc->stats_enabled = enable;
+}
+
+void allocman_get_stats(allocman_t *alloc, struct allocman_stats *stats)
+{
+    *stats = alloc->stats;
+}
+
+static void _reset_space_stats(struct allocman_space_stats *stats)
+{
+    *stats = (struct allocman_space_stats) {
+        .live = stats->live,
+        .max_live = stats->live
+    };
+}
+
+void allocman_reset_stats(allocman_t *alloc)
+{
+    struct allocman_stats *stats = &alloc->stats;
+    _reset_space_stats(&stats->cspace);
+    _reset_space_stats(&stats->mspace);
+    _reset_space_stats(&stats->utspace);
+    stats->max_mspace_bytes = stats->mspace_bytes;
+    stats->max_utspace_bytes = stats->utspace_bytes;
+    memset(stats->mspace_sizes, 0, sizeof(stats->mspace_sizes));
+    memset(stats->utspace_sizes, 0, sizeof(stats->utspace_sizes));
+    memset(stats->utspace_types, 0, sizeof(stats->utspace_types));
+    alloc->watermark_stats = (struct allocman_watermark_stats) {
+        0
+    };
+}
+
+static void _print_space_stats(const char *name, struct allocman_space_stats *stats)
+{
+    printf("allocman %s: alloc %zu fail %zu free %zu live %zu/%zu depth %zu/%zu time %"PRIu64"/%"PRIu64"\n",
+           name, stats->allocs, stats->failed_allocs, stats->frees, stats->live, stats->max_live,
+           stats->max_alloc_depth, stats->max_free_depth, stats->alloc_time, stats->free_time);
+}
+
+static void _print_histogram(const char *name, size_t *buckets, size_t num)
+{
+    printf("allocman %s:", name);
+    for (size_t i = 0; i < num; i++) {
+        if (buckets[i] != 0) {
+            printf(" %zu:%zu", i, buckets[i]);
+        }
+    }
+    printf("\n");
+}
+
+void allocman_print_stats(allocman_t *alloc)
+{
+    struct allocman_stats *stats = &alloc->stats;
+    struct allocman_watermark_stats *wm = &alloc->watermark_stats;
+
+    _print_space_stats("cspace", &stats->cspace);
+    _print_space_stats("mspace", &stats->mspace);
+    _print_space_stats("utspace", &stats->utspace);
+    printf("allocman bytes: mspace %zu/%zu utspace %zu/%zu\n", stats->mspace_bytes, stats->max_mspace_bytes,
+           stats->utspace_bytes, stats->max_utspace_bytes);
+    _print_histogram("mspace sizes", stats->mspace_sizes, ARRAY_SIZE(stats->mspace_sizes));
+    _print_histogram("utspace sizes", stats->utspace_sizes, ARRAY_SIZE(stats->utspace_sizes));
+    _print_histogram("utspace types", stats->utspace_types, ARRAY_SIZE(stats->utspace_types));
+    printf("allocman reserves: used c%zu m%zu u%zu refills %zu refilled %zu max %zu time %"PRIu64"/%"PRIu64"\n",
+           wm->cspace_used, wm->mspace_used, wm->utspace_used, wm->refills, wm->refilled, wm->max_refilled,
+           wm->refill_time, wm->max_refill_time);
+}
+
 int allocman_create(allocman_t *alloc, struct mspace_interface mspace)
 {
     /* zero out the struct */
@@ -448,8 +677,8 @@ int allocman_fill_reserves(allocman_t *alloc)
     int root = _start_operation(alloc);
     /* force the reserves to be checked */
     alloc->used_watermark = 1;
-    /* attempt to fill */
-    full = _refill_watermark(alloc);
+    /* attempt to fill, however long it takes */
+    full = _refill_watermark(alloc, 0);
     _end_operation(alloc, root);
     return full;
 }
@@ -60,12 +60,22 @@ struct bootstrap_info {
     simple_t *simple;
 };
 
+typedef struct pending_device_ut {
+    cspacepath_t path;
+    size_t size_bits;
+    uintptr_t paddr;
+} pending_device_ut_t;
+
 typedef struct add_untypeds_state {
     int num_regions;
     bool region_alloc;
     pmem_region_t *regions;
     utspace_split_t split_ut;
     utspace_interface_t ut_interface;
+    /* device untypeds overlapping ram that are split when first needed */
+    size_t max_pending;
+    size_t num_pending;
+    pending_device_ut_t *pending;
 } add_untypeds_state_t;
 
 static void bootstrap_free_info(bootstrap_info_t *bs)
@@ -519,6 +529,8 @@ int bootstrap_transfer_caps_simple(bootstrap_info_t *bs, simple_t *simple, int l
     size_t i;
     size_t cap_count = simple_get_cap_count(simple);
     seL4_CPtr cnode = simple_get_cnode(simple);
+    simple_cap_table_t caps;
+    simple_cap_table_init(simple, &caps);
 
     for (i = 0ul; i < cap_count; i++) {
         seL4_CPtr pos = simple_get_nth_cap(simple, i);
@@ -528,7 +540,7 @@ int bootstrap_transfer_caps_simple(bootstrap_info_t *bs, simple_t *simple, int l
          * Also don't move any untyped caps, the untyped allocator is looking
          * after those now.
          */
-        if (pos == cnode || simple_is_untyped_cap(simple, pos)) {
+        if (pos == cnode || simple_cap_table_is_untyped(&caps, pos)) {
             continue;
         }
 
@@ -1173,8 +1185,59 @@ static int prepare_handle_device_untyped_cap(allocman_t *alloc, simple_t *simple
     return 0;
 }
 
-int allocman_add_simple_untypeds_with_regions(allocman_t *alloc, simple_t *simple, int num_regions,
-                                              pmem_region_t *region_list)
+static bool device_untyped_overlaps_ram(add_untypeds_state_t *state, uintptr_t paddr, size_t size_bits)
+{
+    uint64_t ut_end = (uint64_t)paddr + BIT(size_bits);
+    for (int i = 0; i < state->num_regions; i++) {
+        pmem_region_t *region = &state->regions[i];
+        uint64_t region_end = region->base_addr + region->length;
+        if (region->type == PMEM_TYPE_RAM && !(paddr >= region_end || ut_end <= region->base_addr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void add_pending_device_uts(allocman_t *alloc, void *pending)
+{
+    add_untypeds_state_t *state = pending;
+    for (size_t i = 0; i < state->num_pending; i++) {
+        pending_device_ut_t *ut = &state->pending[i];
+        int error = handle_device_untyped_cap(state, ut->paddr, ut->size_bits, &ut->path, alloc);
+        ZF_LOGF_IF(error, "bootstrap_arch_handle_device_untyped_cap failed.");
+    }
+    allocman_mspace_free(alloc, state->pending, sizeof(pending_device_ut_t) * state->max_pending);
+    free_device_untyped_cap_state(alloc, state);
+}
+
+/* Set up the state to defer splitting device untypeds that overlap ram. The regions are
+ * copied as the caller's list may not live until the untypeds are split.
+ * Returns false if deferring is not possible, and the untypeds should be split now. */
+static bool prepare_lazy_device_untypeds(allocman_t *alloc, add_untypeds_state_t *state, size_t max_pending)
+{
+    int error;
+    state->pending = allocman_mspace_alloc(alloc, sizeof(pending_device_ut_t) * max_pending, &error);
+    if (error) {
+        return false;
+    }
+    if (!state->region_alloc) {
+        pmem_region_t *regions = allocman_mspace_alloc(alloc, sizeof(pmem_region_t) * state->num_regions, &error);
+        if (error) {
+            allocman_mspace_free(alloc, state->pending, sizeof(pending_device_ut_t) * max_pending);
+            state->pending = NULL;
+            return false;
+        }
+        memcpy(regions, state->regions, sizeof(pmem_region_t) * state->num_regions);
+        state->regions = regions;
+        state->region_alloc = true;
+    }
+    state->max_pending = max_pending;
+    state->num_pending = 0;
+    return true;
+}
+
+static int add_simple_untypeds(allocman_t *alloc, simple_t *simple, int num_regions, pmem_region_t *region_list,
+                               bool lazy)
 {
     add_untypeds_state_t *state = NULL;
     int error = prepare_handle_device_untyped_cap(alloc, simple, &state, num_regions, region_list);
@@ -1183,28 +1246,57 @@ int allocman_add_simple_untypeds_with_regions(allocman_t *alloc, simple_t *simpl
     size_t i;
     size_t total_untyped = simple_get_untyped_count(simple);
 
+    if (state && lazy) {
+        lazy = prepare_lazy_device_untypeds(alloc, state, total_untyped);
+    }
+
     for (i = 0; i < total_untyped; i++) {
         size_t size_bits;
         uintptr_t paddr;
         bool device;
         cspacepath_t path = allocman_cspace_make_path(alloc, simple_get_nth_untyped(simple, i, &size_bits, &paddr, &device));
         int dev_type = device ? ALLOCMAN_UT_DEV : ALLOCMAN_UT_KERNEL;
-        // If it is regular UT memory, then we add cap and move on.
-        if (dev_type == ALLOCMAN_UT_KERNEL) {
-            error = allocman_utspace_add_uts(alloc, 1, &path, &size_bits, &paddr, dev_type);
-            ZF_LOGF_IF(error, "Could not add kernel untyped.");
+        // If it is regular UT memory, or device memory that doesn't need splitting, then we add cap
+        // and move on. The reserves are filled once all untypeds have been added.
+        if (dev_type == ALLOCMAN_UT_KERNEL || state == NULL || !device_untyped_overlaps_ram(state, paddr, size_bits)) {
+            error = alloc->utspace.add_uts(alloc, alloc->utspace.utspace, 1, &path, &size_bits, &paddr, dev_type);
+            ZF_LOGF_IF(error, "Could not add untyped.");
+        } else if (lazy) {
+            state->pending[state->num_pending++] = (pending_device_ut_t) {
+                .path = path, .size_bits = size_bits, .paddr = paddr
+            };
         } else {
             // Otherwise we are Device untyped.
             error = handle_device_untyped_cap(state, paddr, size_bits, &path, alloc);
             ZF_LOGF_IF(error, "bootstrap_arch_handle_device_untyped_cap failed.");
         }
     }
-    if (state) {
+    if (state && lazy && state->num_pending > 0) {
+        assert(alloc->pending_device_uts == NULL);
+        alloc->pending_device_uts = state;
+        alloc->add_pending_device_uts = add_pending_device_uts;
+    } else if (state) {
+        if (lazy) {
+            allocman_mspace_free(alloc, state->pending, sizeof(pending_device_ut_t) * state->max_pending);
+        }
         free_device_untyped_cap_state(alloc, state);
     }
+    allocman_fill_reserves(alloc);
     return 0;
 }
 
+int allocman_add_simple_untypeds_with_regions(allocman_t *alloc, simple_t *simple, int num_regions,
+                                              pmem_region_t *region_list)
+{
+    return add_simple_untypeds(alloc, simple, num_regions, region_list, false);
+}
+
+int allocman_add_simple_untypeds_lazy(allocman_t *alloc, simple_t *simple, int num_regions,
+                                      pmem_region_t *region_list)
+{
+    return add_simple_untypeds(alloc, simple, num_regions, region_list, true);
+}
+
 int allocman_add_simple_untypeds(allocman_t *alloc, simple_t *simple)
 {
     return allocman_add_simple_untypeds_with_regions(alloc, simple, 0, NULL);
@@ -1307,12 +1399,14 @@ static int allocman_add_bootinfo_untypeds(allocman_t *alloc, seL4_BootInfo *bi)
         slot = allocman_cspace_make_path(alloc, i);
         size_bits = bi->untypedList[index].sizeBits;
         paddr = bi->untypedList[index].paddr;
-        error = allocman_utspace_add_uts(alloc, 1, &slot, &size_bits, &paddr,
-                                         bi->untypedList[index].isDevice ? ALLOCMAN_UT_DEV : ALLOCMAN_UT_KERNEL);
+        /* add directly to the utspace, the reserves are filled once all untypeds have been added */
+        error = alloc->utspace.add_uts(alloc, alloc->utspace.utspace, 1, &slot, &size_bits, &paddr,
+                                       bi->untypedList[index].isDevice ? ALLOCMAN_UT_DEV : ALLOCMAN_UT_KERNEL);
         if (error) {
             return error;
         }
     }
+    allocman_fill_reserves(alloc);
     return 0;
 }
 
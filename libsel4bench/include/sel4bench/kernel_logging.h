@@ -13,6 +13,8 @@
 #include <sel4/benchmark_tracepoints_types.h>
 #include <sel4/arch/syscalls.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #if CONFIG_MAX_NUM_TRACE_POINTS > 0
 #define KERNEL_MAX_NUM_LOG_ENTRIES (BIT(seL4_LargePageBits) / sizeof(benchmark_tracepoint_log_entry_t))
@@ -73,11 +75,16 @@ static inline void kernel_logging_reset_log(void)
 
 /* Calls to kernel_logging_sync_log will extract entries created before
  * the most-recent call to this function. Call this function before calling
- * kernel_logging_sync_log. */
-static inline void kernel_logging_finalize_log(void)
+ * kernel_logging_sync_log.
+ *
+ * Returns the number of entries the kernel has logged since the log was last
+ * reset, which keeps counting past KERNEL_MAX_NUM_LOG_ENTRIES once the log is full. */
+static inline seL4_Word kernel_logging_finalize_log(void)
 {
 #ifdef CONFIG_ENABLE_BENCHMARKS
-    seL4_BenchmarkFinalizeLog();
+    return seL4_BenchmarkFinalizeLog();
+#else
+    return 0;
 #endif /* CONFIG_ENABLE_BENCHMARKS */
 }
 
@@ -95,3 +102,76 @@ static inline seL4_Error kernel_logging_set_log_buffer(seL4_CPtr logBuffer_cap)
     return seL4_NoError;
 #endif /* CONFIG_KERNEL_LOG_BUFFER */
 }
+
+#if CONFIG_MAX_NUM_TRACE_POINTS > 0
+/* Streaming drain of the kernel log.
+ *
+ * The kernel appends entries to the shared log buffer frame until it is full,
+ * at which point it stops logging. To trace indefinitely, a consumer thread
+ * calls kernel_logging_stream_poll periodically. Each poll copies newly
+ * appended entries out of the shared frame into the active one of two user
+ * buffers, and resets the kernel log once it passes a threshold so that the
+ * kernel never runs out of room.
+ *
+ * When the active buffer fills it is handed to the sink, and logging continues
+ * into the other buffer. The sink owns a buffer until it calls
+ * kernel_logging_stream_release, which it may do from within the sink callback
+ * (synchronous sinks, such as a serial dump) or later from another thread
+ * (asynchronous sinks, such as a file writer). Release must only be called once
+ * the sink has finished reading the buffer. If both buffers are owned by the
+ * sink, new entries are dropped and counted.
+ *
+ * Entries logged by the kernel between the last poll before a reset and the
+ * reset itself, or after the kernel's buffer filled up, cannot be recovered;
+ * the latter are counted by kernel_dropped.
+ *
+ * Every poll finalises the kernel log, which also stops the kernel's utilisation
+ * tracking (CONFIG_BENCHMARK_TRACK_UTILISATION) until the log is next reset. A
+ * stream must not be used while utilisation is being measured, for example with
+ * sel4utils_utilisation_table_t.
+ */
+typedef void (*kernel_logging_sink_fn)(void *cookie, kernel_log_entry_t *entries, unsigned int num_entries);
+
+typedef struct kernel_logging_stream {
+    /* user mapping of the frame passed to kernel_logging_set_log_buffer */
+    kernel_log_entry_t *kernel_log;
+    /* entries already copied out of the kernel log since its last reset */
+    seL4_Word consumed;
+    /* reset the kernel log once it holds at least this many entries */
+    seL4_Word reset_threshold;
+
+    kernel_log_entry_t *buffers[2];
+    /* accessed atomically, as release may be called from another thread */
+    bool owned_by_sink[2];
+    unsigned int capacity;
+    unsigned int active;
+    unsigned int fill;
+
+    kernel_logging_sink_fn sink;
+    void *cookie;
+
+    /* entries copied out of the kernel log */
+    uint64_t total;
+    /* entries lost because both buffers were owned by the sink */
+    uint64_t dropped;
+    /* entries the kernel logged after its buffer was full, which were never stored */
+    uint64_t kernel_dropped;
+} kernel_logging_stream_t;
+
+/* Initialise a stream. buffers must both hold capacity entries. A reset_threshold of 0
+ * selects half of KERNEL_MAX_NUM_LOG_ENTRIES. Resets the kernel log. */
+void kernel_logging_stream_init(kernel_logging_stream_t *stream, kernel_log_entry_t *kernel_log,
+                                seL4_Word reset_threshold,
+                                kernel_log_entry_t *buffer0, kernel_log_entry_t *buffer1,
+                                unsigned int capacity, kernel_logging_sink_fn sink, void *cookie);
+
+/* Copy any entries appended to the kernel log since the last poll, handing full buffers to the sink.
+ * Returns the number of entries copied. */
+unsigned int kernel_logging_stream_poll(kernel_logging_stream_t *stream);
+
+/* Poll one final time and hand the partially filled active buffer to the sink. */
+void kernel_logging_stream_flush(kernel_logging_stream_t *stream);
+
+/* Return a buffer previously handed to the sink so that it can be reused. */
+void kernel_logging_stream_release(kernel_logging_stream_t *stream, kernel_log_entry_t *buffer);
+#endif /* CONFIG_MAX_NUM_TRACE_POINTS > 0 */
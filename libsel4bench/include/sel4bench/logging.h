@@ -9,6 +9,7 @@
 #include <sel4/types.h>
 #include <sel4/constants.h>
 #include <sel4bench/kernel_logging.h>
+#include <sel4bench/stats.h>
 
 /* Log format matching the one used in the kernel.
  * This will be used as a generic log entry struct.
@@ -39,18 +40,30 @@ void logging_append_log_buffer(log_buffer_t *log_buffer, seL4_Word data);
 void logging_separate_log(kernel_log_entry_t *logs, unsigned int num_logs, log_buffer_t *buffers, unsigned int num_buffers);
 
 /* Sorts an array of logs in place, in ascending order of key.
- * Not necessarily a stable sort.
+ * Not necessarily a stable sort. Runs in O(n) time unless a scratch buffer
+ * of num_logs entries cannot be allocated.
  */
 void logging_sort_log(kernel_log_entry_t *logs, unsigned int num_logs);
 
 /* Sorts an array of logs in place, in ascending order of key.
- * Guaranteed to be stable.
+ * Guaranteed to be stable. Runs in O(n) time unless a scratch buffer
+ * of num_logs entries cannot be allocated.
  */
 void logging_stable_sort_log(kernel_log_entry_t *logs, unsigned int num_logs);
 
 /* Given a sorted array of logs, for each distinct key, records the offset in the now sorted array
  * containing the first occurence of that key, and the number of elements in the array with that key.
+ * Keys greater than or equal to max_groups are ignored.
  */
 void logging_group_log_by_key(kernel_log_entry_t *logs, unsigned int num_logs,
                               unsigned int *sizes, unsigned int *offsets,
                               unsigned int max_groups);
+
+/* Given an array of log entries and an array of initialised stats objects, adds the data field of
+ * each entry to the stats object whose position in the array corresponds to the entry's key field.
+ * Entries with keys greater than or equal to num_summaries are ignored. The log does not need to
+ * be sorted, and no entries are copied, so a log can be summarised without per-key buffers.
+ * Results are queried with the sel4bench_stats_* functions.
+ */
+void logging_summarise_log(kernel_log_entry_t *logs, unsigned int num_logs,
+                           sel4bench_stats_t *summaries, unsigned int num_summaries);
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sel4bench/sel4bench.h>
+
+/**
+ * @file
+ *
+ * Multiplexed event counting, for measuring more events than there are
+ * hardware counters in a single run.
+ *
+ * The event list is split into chunks of `sel4bench_get_num_counters()` events,
+ * as for `sel4bench_enable_counters()`, and the chunk programmed into the
+ * counters is rotated as the workload runs, either every N iterations or every
+ * N cycles. Each event's raw count is accumulated along with the number of
+ * cycles it was being counted for, and the final estimate for each event is
+ * scaled up by the ratio of total cycles to enabled cycles.
+ *
+ * The estimate is only as good as the workload is uniform across rotations:
+ * rotate often relative to any phase changes in the workload.
+ *
+ * This is built purely on the generic counter interface, so works with any
+ * architecture backend.
+ */
+
+typedef struct sel4bench_multiplex {
+    seL4_Word n_events;
+    event_id_t *events;
+    seL4_Word n_counters;
+    seL4_Word n_chunks;
+
+    /* chunk currently programmed into the counters and its counter mask */
+    seL4_Word chunk;
+    counter_bitfield_t mask;
+
+    /* rotation policy; a value of 0 disables that trigger */
+    seL4_Word rotate_iterations;
+    uint64_t rotate_cycles;
+    seL4_Word iterations;
+
+    /* cycle count when the run and the current chunk were started */
+    ccnt_t run_start;
+    ccnt_t chunk_start;
+    uint64_t total_cycles;
+
+    /* per-event raw counts and the cycles each event was counted for,
+     * provided by the caller and n_events long */
+    uint64_t *raw;
+    uint64_t *enabled;
+
+    /* number of rotations performed */
+    seL4_Word rotations;
+} sel4bench_multiplex_t;
+
+/**
+ * Start a multiplexed run. Programs and starts the first chunk of events.
+ *
+ * @param mux               multiplexer state to initialise
+ * @param n_events          number of events of interest. If 0, or the platform
+ *                          has no counters, only cycles are tracked
+ * @param events            events to track; must remain valid for the run
+ * @param raw               storage for n_events raw counts
+ * @param enabled           storage for n_events enabled cycle counts
+ * @param rotate_iterations rotate every this many calls to
+ *                          `sel4bench_multiplex_tick()`, or 0
+ * @param rotate_cycles     rotate at the first tick after this many cycles
+ *                          have elapsed on the current chunk, or 0
+ */
+void sel4bench_multiplex_start(sel4bench_multiplex_t *mux, seL4_Word n_events, event_id_t *events,
+                               uint64_t *raw, uint64_t *enabled,
+                               seL4_Word rotate_iterations, uint64_t rotate_cycles);
+
+/**
+ * Accumulate the current chunk's counters and program the next chunk.
+ *
+ * @param mux multiplexer state
+ */
+void sel4bench_multiplex_rotate(sel4bench_multiplex_t *mux);
+
+/**
+ * Mark one iteration of the workload, rotating if the policy given to
+ * `sel4bench_multiplex_start()` says it is time to.
+ *
+ * @param mux multiplexer state
+ */
+static inline void sel4bench_multiplex_tick(sel4bench_multiplex_t *mux)
+{
+    mux->iterations++;
+    if (mux->rotate_iterations != 0 && mux->iterations >= mux->rotate_iterations) {
+        sel4bench_multiplex_rotate(mux);
+    } else if (mux->rotate_cycles != 0 &&
+               (ccnt_t)(sel4bench_get_cycle_count() - mux->chunk_start) >= mux->rotate_cycles) {
+        sel4bench_multiplex_rotate(mux);
+    }
+}
+
+/**
+ * Finish a multiplexed run, accumulating and stopping the current chunk.
+ *
+ * @param mux multiplexer state
+ */
+void sel4bench_multiplex_stop(sel4bench_multiplex_t *mux);
+
+/**
+ * Query the scaled estimate of an event's count over the whole run.
+ *
+ * @param mux   multiplexer state of a stopped run
+ * @param event index into the events array passed to
+ *              `sel4bench_multiplex_start()`
+ *
+ * @return raw count scaled by total cycles / enabled cycles, or 0 if the
+ *         event was never counted
+ */
+uint64_t sel4bench_multiplex_get(sel4bench_multiplex_t *mux, seL4_Word event);
@@ -218,6 +218,8 @@ static inline int sel4bench_get_num_counter_chunks(seL4_Word n_counters,
  * `n_counters` is a parameter because calling `sel4bench_get_num_counters()`
  * can be expensive, but it should be the same as the function's return value.
  *
+ * To count every chunk in a single run, see `sel4bench/multiplex.h`.
+ *
  * @param n_events   number of events of interest
  * @param event      events to track
  * @param chunk      chunk number to enable
@@ -255,6 +257,8 @@ counter_bitfield_t sel4bench_enable_counters(seL4_Word n_events,
  * `n_counters` is a parameter because calling `sel4bench_get_num_counters()`
  * can be expensive, but it should be the same as the function's return value.
  *
+ * To count every chunk in a single run, see `sel4bench/multiplex.h`.
+ *
  * `results` must point to an array the size of n_events, as passed to
  * `sel4bench_enable_counters()`.
  *
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @file
+ *
+ * Fixed-memory online statistics for benchmark samples.
+ *
+ * Samples are folded into a `sel4bench_stats_t` as they are taken, so a
+ * benchmark can run for an arbitrary number of iterations without storing
+ * every sample. Alongside the count, min, max, mean and variance (using
+ * Welford's algorithm), a log-linear histogram records the distribution with
+ * a bounded relative error, from which percentiles can be queried.
+ *
+ * Two stats objects can be merged, so results gathered independently on
+ * different threads or cores can be combined into a single result.
+ */
+
+/* Each power of two range is divided into 2^SEL4BENCH_STATS_SUB_BUCKET_BITS
+ * linear sub-buckets, bounding the relative error of percentiles to
+ * 2^-SEL4BENCH_STATS_SUB_BUCKET_BITS. */
+#define SEL4BENCH_STATS_SUB_BUCKET_BITS 4
+
+#define SEL4BENCH_STATS_SUB_BUCKETS (1ull << SEL4BENCH_STATS_SUB_BUCKET_BITS)
+
+/* Values below SEL4BENCH_STATS_SUB_BUCKETS are recorded exactly, and every
+ * remaining power of two up to 2^64 gets SEL4BENCH_STATS_SUB_BUCKETS buckets. */
+#define SEL4BENCH_STATS_NUM_BUCKETS \
+    ((64 - SEL4BENCH_STATS_SUB_BUCKET_BITS + 1) * SEL4BENCH_STATS_SUB_BUCKETS)
+
+typedef struct sel4bench_stats {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    /* Running mean and sum of squared differences from the mean */
+    double mean;
+    double m2;
+    uint64_t buckets[SEL4BENCH_STATS_NUM_BUCKETS];
+} sel4bench_stats_t;
+
+/**
+ * Reset a stats object so that it contains no samples.
+ *
+ * @param stats stats object to reset
+ */
+void sel4bench_stats_init(sel4bench_stats_t *stats);
+
+/**
+ * Record a single sample.
+ *
+ * @param stats stats object to update
+ * @param value sample to record
+ */
+void sel4bench_stats_add(sel4bench_stats_t *stats, uint64_t value);
+
+/**
+ * Merge the samples recorded in one stats object into another. The result is
+ * the same as if every sample in `src` had been added to `dest`.
+ *
+ * @param dest stats object to merge into
+ * @param src  stats object to merge from; unmodified
+ */
+void sel4bench_stats_merge(sel4bench_stats_t *dest, const sel4bench_stats_t *src);
+
+/**
+ * @return the sample variance of recorded samples, or 0 if there are fewer
+ * than two
+ */
+double sel4bench_stats_variance(const sel4bench_stats_t *stats);
+
+/**
+ * Query a percentile of the recorded samples. The result is the upper bound
+ * of the histogram bucket containing the percentile, clamped to the observed
+ * minimum and maximum.
+ *
+ * @param stats      stats object to query
+ * @param percentile percentile to query, from 0 to 100
+ *
+ * @return the requested percentile, or 0 if no samples have been recorded
+ */
+uint64_t sel4bench_stats_percentile(const sel4bench_stats_t *stats, double percentile);
+
+/**
+ * Print a stats object to stdout in a compact, line based, machine readable
+ * form, suitable for scraping from a serial console:
+ *
+ *     STATS <name> n=<count> min=<min> max=<max> mean=<mean> var=<var> p50=.. p90=.. p99=.. p999=..
+ *     HIST <name> <bucket>:<count> <bucket>:<count> ...
+ *
+ * Only non-empty histogram buckets are listed, by bucket index. The histogram
+ * line can be used to reconstruct and merge results offline.
+ *
+ * @param name  identifier for the results, must not contain whitespace
+ * @param stats stats object to print
+ */
+void sel4bench_stats_print(const char *name, const sel4bench_stats_t *stats);
@@ -5,6 +5,9 @@
  */
 
 #include <sel4bench/kernel_logging.h>
+#include <assert.h>
+#include <string.h>
+#include <utils/util.h>
 
 #if CONFIG_MAX_NUM_TRACE_POINTS > 0
 unsigned int
@@ -12,4 +15,104 @@ kernel_logging_sync_log(kernel_log_entry_t log[], unsigned int n)
 {
     return 0;
 }
+
+void
+kernel_logging_stream_init(kernel_logging_stream_t *stream, kernel_log_entry_t *kernel_log,
+                           seL4_Word reset_threshold,
+                           kernel_log_entry_t *buffer0, kernel_log_entry_t *buffer1,
+                           unsigned int capacity, kernel_logging_sink_fn sink, void *cookie)
+{
+    assert(reset_threshold <= KERNEL_MAX_NUM_LOG_ENTRIES);
+    memset(stream, 0, sizeof(*stream));
+    stream->kernel_log = kernel_log;
+    stream->reset_threshold = reset_threshold ? reset_threshold : KERNEL_MAX_NUM_LOG_ENTRIES / 2;
+    stream->buffers[0] = buffer0;
+    stream->buffers[1] = buffer1;
+    stream->capacity = capacity;
+    stream->sink = sink;
+    stream->cookie = cookie;
+    kernel_logging_reset_log();
+}
+
+/* Hand the active buffer to the sink and switch to the other one */
+static void
+stream_handoff(kernel_logging_stream_t *stream)
+{
+    unsigned int full = stream->active;
+    unsigned int fill = stream->fill;
+
+    /* only cleared by kernel_logging_stream_release, possibly on another thread */
+    __atomic_store_n(&stream->owned_by_sink[full], true, __ATOMIC_RELAXED);
+    stream->active = !full;
+    stream->fill = 0;
+    stream->sink(stream->cookie, stream->buffers[full], fill);
+}
+
+static void
+stream_append(kernel_logging_stream_t *stream, kernel_log_entry_t *entries, unsigned int num_entries)
+{
+    while (num_entries > 0) {
+        /* acquire pairs with the release in kernel_logging_stream_release, so the
+         * consumer has finished reading the buffer before it is overwritten */
+        if (__atomic_load_n(&stream->owned_by_sink[stream->active], __ATOMIC_ACQUIRE)) {
+            stream->dropped += num_entries;
+            return;
+        }
+        unsigned int n = MIN(num_entries, stream->capacity - stream->fill);
+        memcpy(&stream->buffers[stream->active][stream->fill], entries, n * sizeof(kernel_log_entry_t));
+        stream->fill += n;
+        entries += n;
+        num_entries -= n;
+        if (stream->fill == stream->capacity) {
+            stream_handoff(stream);
+        }
+    }
+}
+
+unsigned int
+kernel_logging_stream_poll(kernel_logging_stream_t *stream)
+{
+    seL4_Word index = kernel_logging_finalize_log();
+    if (index > KERNEL_MAX_NUM_LOG_ENTRIES) {
+        /* the kernel keeps counting entries once its buffer is full, without storing them */
+        stream->kernel_dropped += index - KERNEL_MAX_NUM_LOG_ENTRIES;
+        index = KERNEL_MAX_NUM_LOG_ENTRIES;
+    }
+    if (index < stream->consumed) {
+        /* the log was reset behind our back */
+        stream->consumed = 0;
+    }
+
+    unsigned int num_entries = index - stream->consumed;
+    stream_append(stream, &stream->kernel_log[stream->consumed], num_entries);
+    stream->consumed = index;
+    stream->total += num_entries;
+
+    if (index >= stream->reset_threshold) {
+        kernel_logging_reset_log();
+        stream->consumed = 0;
+    }
+    return num_entries;
+}
+
+void
+kernel_logging_stream_flush(kernel_logging_stream_t *stream)
+{
+    kernel_logging_stream_poll(stream);
+    if (stream->fill > 0 && !__atomic_load_n(&stream->owned_by_sink[stream->active], __ATOMIC_ACQUIRE)) {
+        stream_handoff(stream);
+    }
+}
+
+void
+kernel_logging_stream_release(kernel_logging_stream_t *stream, kernel_log_entry_t *buffer)
+{
+    for (int i = 0; i < ARRAY_SIZE(stream->buffers); i++) {
+        if (stream->buffers[i] == buffer) {
+            __atomic_store_n(&stream->owned_by_sink[i], false, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    assert(!"buffer does not belong to this stream");
+}
 #endif
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <assert.h>
+#include <string.h>
+#include <utils/util.h>
 
 void
 logging_init_log_buffer(log_buffer_t *log_buffer, unsigned int initial_capacity)
@@ -45,10 +47,40 @@ logging_append_log_buffer(log_buffer_t *log_buffer, seL4_Word data)
     }
 }
 
+static void
+reserve_log_buffer(log_buffer_t *log_buffer, unsigned int capacity)
+{
+    if (capacity <= log_buffer->capacity) {
+        return;
+    }
+    seL4_Word *new_buffer = (seL4_Word *)realloc(log_buffer->buffer, capacity * sizeof(seL4_Word));
+    if (new_buffer != NULL) {
+        log_buffer->buffer = new_buffer;
+        log_buffer->capacity = capacity;
+    }
+}
+
 void
 logging_separate_log(kernel_log_entry_t *logs, unsigned int num_logs, log_buffer_t *buffers, unsigned int num_buffers)
 {
-    for (int i = 0; i < num_logs; ++i) {
+    unsigned int *counts = (unsigned int *)calloc(num_buffers, sizeof(unsigned int));
+    if (counts != NULL) {
+        /* Size every buffer exactly once rather than doubling as we go */
+        for (unsigned int i = 0; i < num_logs; ++i) {
+            seL4_Word key = kernel_logging_entry_get_key(&logs[i]);
+            if (key < num_buffers) {
+                ++counts[key];
+            }
+        }
+        for (unsigned int i = 0; i < num_buffers; ++i) {
+            if (counts[i] > 0) {
+                reserve_log_buffer(&buffers[i], buffers[i].length + counts[i]);
+            }
+        }
+        free(counts);
+    }
+
+    for (unsigned int i = 0; i < num_logs; ++i) {
         kernel_log_entry_t *entry = &logs[i];
         seL4_Word key = kernel_logging_entry_get_key(entry);
         seL4_Word data = kernel_logging_entry_get_data(entry);
@@ -61,33 +93,94 @@ logging_separate_log(kernel_log_entry_t *logs, unsigned int num_logs, log_buffer
 static int
 log_compare(const void *a, const void *b)
 {
-    return kernel_logging_entry_get_key((kernel_log_entry_t*)a) -
-           kernel_logging_entry_get_key((kernel_log_entry_t*)b);
+    seL4_Word key_a = kernel_logging_entry_get_key((kernel_log_entry_t *)a);
+    seL4_Word key_b = kernel_logging_entry_get_key((kernel_log_entry_t *)b);
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+/* Number of key bits consumed by each pass of the radix sort */
+#define RADIX_BITS 8
+#define RADIX_SIZE BIT(RADIX_BITS)
+#define RADIX_MASK MASK(RADIX_BITS)
+
+/* LSD radix sort on the key field. Each pass is a stable counting sort, and
+ * only as many passes as there are significant digits in the largest key
+ * are performed, so for tracepoint ids this is usually a single pass.
+ * Returns -1 if the scratch buffer could not be allocated. */
+static int
+radix_sort_log(kernel_log_entry_t *logs, unsigned int num_logs)
+{
+    seL4_Word max_key = 0;
+    for (unsigned int i = 0; i < num_logs; ++i) {
+        max_key = MAX(max_key, kernel_logging_entry_get_key(&logs[i]));
+    }
+    if (max_key == 0) {
+        /* All keys are equal, so the log is already sorted */
+        return 0;
+    }
+
+    kernel_log_entry_t *scratch = (kernel_log_entry_t *)malloc(num_logs * sizeof(kernel_log_entry_t));
+    if (scratch == NULL) {
+        return -1;
+    }
+
+    kernel_log_entry_t *src = logs;
+    kernel_log_entry_t *dst = scratch;
+    for (unsigned int shift = 0; shift < seL4_WordBits && (max_key >> shift) != 0; shift += RADIX_BITS) {
+        unsigned int counts[RADIX_SIZE] = {0};
+        for (unsigned int i = 0; i < num_logs; ++i) {
+            ++counts[(kernel_logging_entry_get_key(&src[i]) >> shift) & RADIX_MASK];
+        }
+        unsigned int offset = 0;
+        for (unsigned int d = 0; d < RADIX_SIZE; ++d) {
+            unsigned int count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+        for (unsigned int i = 0; i < num_logs; ++i) {
+            dst[counts[(kernel_logging_entry_get_key(&src[i]) >> shift) & RADIX_MASK]++] = src[i];
+        }
+        kernel_log_entry_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != logs) {
+        memcpy(logs, src, num_logs * sizeof(kernel_log_entry_t));
+    }
+    free(scratch);
+    return 0;
+}
+
+/* In-place stable fallback for when no scratch memory is available */
+static void
+insertion_sort_log(kernel_log_entry_t *logs, unsigned int num_logs)
+{
+    for (unsigned int i = 1; i < num_logs; ++i) {
+        kernel_log_entry_t entry = logs[i];
+        seL4_Word key = kernel_logging_entry_get_key(&entry);
+        unsigned int j = i;
+        while (j > 0 && kernel_logging_entry_get_key(&logs[j - 1]) > key) {
+            logs[j] = logs[j - 1];
+            --j;
+        }
+        logs[j] = entry;
+    }
 }
 
 void
 logging_sort_log(kernel_log_entry_t *logs, unsigned int num_logs)
 {
-    qsort(logs, num_logs, sizeof(kernel_log_entry_t), log_compare);
+    if (radix_sort_log(logs, num_logs) != 0) {
+        qsort(logs, num_logs, sizeof(kernel_log_entry_t), log_compare);
+    }
 }
 
 void
 logging_stable_sort_log(kernel_log_entry_t *logs, unsigned int num_logs)
 {
-    /* Modify the keys so sorting preserves order within a single key */
-    for (int i = 0; i < num_logs; ++i) {
-        kernel_log_entry_t *entry = &logs[i];
-        seL4_Word key = kernel_logging_entry_get_key(entry);
-        key = key * num_logs + i;
-    }
-
-    logging_sort_log(logs, num_logs);
-
-    /* Restore the original key values */
-    for (int i = 0; i < num_logs; ++i) {
-        kernel_log_entry_t *entry = &logs[i];
-        seL4_Word key = kernel_logging_entry_get_key(entry);
-        key = key / num_logs;
+    if (radix_sort_log(logs, num_logs) != 0) {
+        insertion_sort_log(logs, num_logs);
     }
 }
 
@@ -96,13 +189,30 @@ logging_group_log_by_key(kernel_log_entry_t *logs, unsigned int num_logs,
                          unsigned int *sizes, unsigned int *offsets,
                          unsigned int max_groups)
 {
+    memset(sizes, 0, max_groups * sizeof(unsigned int));
+    for (unsigned int i = 0; i < num_logs; ++i) {
+        seL4_Word key = kernel_logging_entry_get_key(&logs[i]);
+        if (key < max_groups) {
+            ++sizes[key];
+        }
+    }
+
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < max_groups; ++i) {
+        offsets[i] = offset;
+        offset += sizes[i];
+    }
+}
 
-    int index = 0;
-    for (int i = 0; i < max_groups; ++i) {
-        offsets[i] = index;
-        while (index < num_logs && kernel_logging_entry_get_key(&logs[index]) == i) {
-            ++index;
+void
+logging_summarise_log(kernel_log_entry_t *logs, unsigned int num_logs,
+                      sel4bench_stats_t *summaries, unsigned int num_summaries)
+{
+    for (unsigned int i = 0; i < num_logs; ++i) {
+        kernel_log_entry_t *entry = &logs[i];
+        seL4_Word key = kernel_logging_entry_get_key(entry);
+        if (key < num_summaries) {
+            sel4bench_stats_add(&summaries[key], kernel_logging_entry_get_data(entry));
         }
-        sizes[i] = index - offsets[i];
     }
 }
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sel4bench/multiplex.h>
+#include <assert.h>
+#include <string.h>
+#include <utils/util.h>
+
+static void
+multiplex_enable_chunk(sel4bench_multiplex_t *mux)
+{
+    mux->mask = sel4bench_enable_counters(mux->n_events, mux->events, mux->chunk, mux->n_counters);
+    mux->iterations = 0;
+    mux->chunk_start = sel4bench_get_cycle_count();
+}
+
+/* Read the counters of the current chunk into the accumulators */
+static void
+multiplex_accumulate(sel4bench_multiplex_t *mux)
+{
+    ccnt_t values[seL4_WordBits];
+    ccnt_t now = sel4bench_get_counters(mux->mask, values);
+    uint64_t elapsed = (ccnt_t)(now - mux->chunk_start);
+
+    for (seL4_Word i = 0; i < mux->n_counters; i++) {
+        seL4_Word event = mux->chunk * mux->n_counters + i;
+        if (event >= mux->n_events) {
+            break;
+        }
+        mux->raw[event] += values[i];
+        mux->enabled[event] += elapsed;
+    }
+    mux->total_cycles += elapsed;
+}
+
+void
+sel4bench_multiplex_start(sel4bench_multiplex_t *mux, seL4_Word n_events, event_id_t *events,
+                          uint64_t *raw, uint64_t *enabled,
+                          seL4_Word rotate_iterations, uint64_t rotate_cycles)
+{
+    memset(mux, 0, sizeof(*mux));
+    mux->n_events = n_events;
+    mux->events = events;
+    /* reading the number of counters may be expensive, so only do it once */
+    mux->n_counters = sel4bench_get_num_counters();
+    assert(mux->n_counters <= seL4_WordBits);
+    /* with no events, or no counters to count them with, there are no chunks and
+     * the run only tracks cycles */
+    if (n_events > 0 && mux->n_counters > 0) {
+        mux->n_chunks = sel4bench_get_num_counter_chunks(mux->n_counters, n_events);
+    }
+    mux->rotate_iterations = rotate_iterations;
+    mux->rotate_cycles = rotate_cycles;
+    mux->raw = raw;
+    mux->enabled = enabled;
+    memset(raw, 0, n_events * sizeof(*raw));
+    memset(enabled, 0, n_events * sizeof(*enabled));
+
+    if (mux->n_chunks > 0) {
+        multiplex_enable_chunk(mux);
+    } else {
+        mux->chunk_start = sel4bench_get_cycle_count();
+    }
+    mux->run_start = mux->chunk_start;
+}
+
+void
+sel4bench_multiplex_rotate(sel4bench_multiplex_t *mux)
+{
+    multiplex_accumulate(mux);
+    mux->rotations++;
+    if (mux->n_chunks <= 1) {
+        /* nothing to rotate to; just restart the interval */
+        mux->iterations = 0;
+        mux->chunk_start = sel4bench_get_cycle_count();
+        if (mux->n_chunks == 1) {
+            sel4bench_reset_counters();
+        }
+        return;
+    }
+    sel4bench_stop_counters(mux->mask);
+    mux->chunk = (mux->chunk + 1) % mux->n_chunks;
+    multiplex_enable_chunk(mux);
+}
+
+void
+sel4bench_multiplex_stop(sel4bench_multiplex_t *mux)
+{
+    multiplex_accumulate(mux);
+    sel4bench_stop_counters(mux->mask);
+    mux->mask = 0;
+}
+
+uint64_t
+sel4bench_multiplex_get(sel4bench_multiplex_t *mux, seL4_Word event)
+{
+    assert(event < mux->n_events);
+    if (mux->enabled[event] == 0) {
+        return 0;
+    }
+    if (mux->enabled[event] == mux->total_cycles) {
+        return mux->raw[event];
+    }
+    return (uint64_t)((double) mux->raw[event] * mux->total_cycles / mux->enabled[event]);
+}
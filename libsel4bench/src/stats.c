@@ -0,0 +1,144 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sel4bench/stats.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils/util.h>
+
+#define SUB_BITS SEL4BENCH_STATS_SUB_BUCKET_BITS
+#define SUB_BUCKETS SEL4BENCH_STATS_SUB_BUCKETS
+
+static inline unsigned int
+stats_bucket(uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int shift = exponent - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* Largest value that falls into a bucket */
+static inline uint64_t
+stats_bucket_upper(unsigned int bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    uint64_t lower = (SUB_BUCKETS + sub) << shift;
+    return lower + ((1ull << shift) - 1);
+}
+
+void
+sel4bench_stats_init(sel4bench_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->min = UINT64_MAX;
+}
+
+void
+sel4bench_stats_add(sel4bench_stats_t *stats, uint64_t value)
+{
+    stats->count++;
+    stats->min = MIN(stats->min, value);
+    stats->max = MAX(stats->max, value);
+
+    double delta = (double) value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * ((double) value - stats->mean);
+
+    stats->buckets[stats_bucket(value)]++;
+}
+
+void
+sel4bench_stats_merge(sel4bench_stats_t *dest, const sel4bench_stats_t *src)
+{
+    if (src->count == 0) {
+        return;
+    }
+    if (dest->count == 0) {
+        memcpy(dest, src, sizeof(*dest));
+        return;
+    }
+
+    /* Chan et al. pairwise combination of mean and squared differences */
+    double n_a = dest->count;
+    double n_b = src->count;
+    double n = n_a + n_b;
+    double delta = src->mean - dest->mean;
+    dest->mean += delta * n_b / n;
+    dest->m2 += src->m2 + delta * delta * n_a * n_b / n;
+
+    dest->count += src->count;
+    dest->min = MIN(dest->min, src->min);
+    dest->max = MAX(dest->max, src->max);
+    for (unsigned int i = 0; i < SEL4BENCH_STATS_NUM_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+}
+
+double
+sel4bench_stats_variance(const sel4bench_stats_t *stats)
+{
+    if (stats->count < 2) {
+        return 0;
+    }
+    return stats->m2 / (stats->count - 1);
+}
+
+uint64_t
+sel4bench_stats_percentile(const sel4bench_stats_t *stats, double percentile)
+{
+    if (stats->count == 0) {
+        return 0;
+    }
+    if (percentile >= 100) {
+        return stats->max;
+    }
+    if (percentile <= 0) {
+        return stats->min;
+    }
+
+    /* rank of the requested sample, rounded up */
+    uint64_t rank = (uint64_t)(stats->count * percentile / 100);
+    if (rank * 100 < stats->count * percentile) {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < SEL4BENCH_STATS_NUM_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen >= rank && stats->buckets[i] != 0) {
+            uint64_t upper = stats_bucket_upper(i);
+            return MAX(stats->min, MIN(stats->max, upper));
+        }
+    }
+    return stats->max;
+}
+
+void
+sel4bench_stats_print(const char *name, const sel4bench_stats_t *stats)
+{
+    printf("STATS %s n=%"PRIu64" min=%"PRIu64" max=%"PRIu64" mean=%.2f var=%.2f "
+           "p50=%"PRIu64" p90=%"PRIu64" p99=%"PRIu64" p999=%"PRIu64"\n",
+           name, stats->count, stats->count ? stats->min : 0, stats->max,
+           stats->mean, sel4bench_stats_variance(stats),
+           sel4bench_stats_percentile(stats, 50), sel4bench_stats_percentile(stats, 90),
+           sel4bench_stats_percentile(stats, 99), sel4bench_stats_percentile(stats, 99.9));
+
+    printf("HIST %s", name);
+    for (unsigned int i = 0; i < SEL4BENCH_STATS_NUM_BUCKETS; i++) {
+        if (stats->buckets[i] != 0) {
+            printf(" %u:%"PRIu64, i, stats->buckets[i]);
+        }
+    }
+    printf("\n");
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/* Print the number of heap allocations that are currently live, as tracked by the
+ * allocation wrappers in alloc.c. If CONFIG_LIBSEL4DEBUG_ALLOC_CALL_SITES is set, the
+ * live allocations are also grouped by the return address of the call that made them.
+ * Tracking must be enabled with CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES.
+ */
+void debug_alloc_report_leaks(void);
@@ -41,10 +41,12 @@
 #include <assert.h>
 #include <autoconf.h>
 #include <sel4debug/gen_config.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h> /* for size_t */
 #include <string.h>
+#include <sel4debug/alloc.h>
 
 /* Maximum alignment of a data type. The malloc spec requires that returned
  * pointers are aligned to this.
@@ -162,32 +164,74 @@ static void *unbox(void *ptr, void *ret_addr)
     return (void *)pre;
 }
 
-/* Buffer for tracking currently live heap pointers. This is used to detect
+/* Hash set for tracking currently live heap pointers. This is used to detect
  * when the user attempts to free an invalid pointer. Note that we always track
- * *boxed* pointers as these are the ones seen by the user.
+ * *boxed* pointers as these are the ones seen by the user. The set uses linear
+ * probing and is kept at most half full so tracking stays cheap with large
+ * buffers.
  */
 #ifndef CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES
 #define CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES 128
 #endif
-static uintptr_t alloced[CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES];
+/* The table has twice as many slots as tracked entries, rounded up to a power
+ * of two so that it can be indexed by the top bits of a hash.
+ */
+#define ALLOC_TABLE_ROUND0 ((size_t)CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES * 2 - 1)
+#define ALLOC_TABLE_ROUND1 (ALLOC_TABLE_ROUND0 | ALLOC_TABLE_ROUND0 >> 1)
+#define ALLOC_TABLE_ROUND2 (ALLOC_TABLE_ROUND1 | ALLOC_TABLE_ROUND1 >> 2)
+#define ALLOC_TABLE_ROUND3 (ALLOC_TABLE_ROUND2 | ALLOC_TABLE_ROUND2 >> 4)
+#define ALLOC_TABLE_ROUND4 (ALLOC_TABLE_ROUND3 | ALLOC_TABLE_ROUND3 >> 8)
+#define ALLOC_TABLE_ROUND5 (ALLOC_TABLE_ROUND4 | ALLOC_TABLE_ROUND4 >> 16)
+#define ALLOC_TABLE_SIZE (CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES > 0 ? ALLOC_TABLE_ROUND5 + 1 : 0)
+/* Mask for indexing the table, which stays valid when tracking is disabled. */
+#define ALLOC_TABLE_MASK (ALLOC_TABLE_SIZE > 0 ? ALLOC_TABLE_SIZE - 1 : 0)
+static uintptr_t alloced[ALLOC_TABLE_SIZE];
+static size_t alloced_count;
+#ifdef CONFIG_LIBSEL4DEBUG_ALLOC_CALL_SITES
+/* Return address of the allocation of each live pointer, for leak reports. */
+static void *alloced_sites[ALLOC_TABLE_SIZE];
+#endif
+
+#if CONFIG_WORD_SIZE == 64
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+#else
+#define HASH_MULTIPLIER 0x9E3779B9ul
+#endif
+
+static size_t alloc_hash(uintptr_t ptr)
+{
+    /* Fibonacci hashing. The top bits of the product depend on every bit of the
+     * pointer, so page aligned or equally sized blocks, which share their low
+     * bits, still spread evenly.
+     */
+    unsigned int bits = __builtin_ctzl(ALLOC_TABLE_MASK + 1);
+    if (bits == 0) {
+        /* Tracking is disabled. */
+        return 0;
+    }
+    return (size_t)((ptr * (uintptr_t)HASH_MULTIPLIER) >> (CONFIG_WORD_SIZE - bits));
+}
 
 /* Track the given heap pointer as currently live. */
-static void track(void *ptr)
+static void track(void *ptr, void *site)
 {
     if (sizeof(alloced) == 0 || ptr == NULL) {
         /* Disable tracking if we have no buffer and never track NULL. */
         return;
     }
-    for (unsigned int i = 0; i < sizeof(alloced) / sizeof(uintptr_t); i++) {
-        if (alloced[i] == 0) {
-            /* Found a free slot. */
-            alloced[i] = (uintptr_t)ptr;
-            return;
-        }
+    if (alloced_count == CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES) {
+        error("Exhausted pointer tracking buffer; try increasing "
+              "CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES value\n");
+    }
+    size_t i = alloc_hash((uintptr_t)ptr);
+    while (alloced[i] != 0) {
+        i = (i + 1) & ALLOC_TABLE_MASK;
     }
-    /* Failed to find a free slot. */
-    error("Exhausted pointer tracking buffer; try increasing "
-          "CONFIG_LIBSEL4DEBUG_ALLOC_BUFFER_ENTRIES value\n");
+    alloced[i] = (uintptr_t)ptr;
+#ifdef CONFIG_LIBSEL4DEBUG_ALLOC_CALL_SITES
+    alloced_sites[i] = site;
+#endif
+    alloced_count++;
 }
 
 /* Stop tracking the given pointer (mark it as dead). */
@@ -197,16 +241,71 @@ static void untrack(void *ptr, void *ret_addr)
         /* Ignore tracking if we have no buffer or are freeing NULL. */
         return;
     }
-    for (unsigned int i = 0; i < sizeof(alloced) / sizeof(uintptr_t); i++) {
-        if (alloced[i] == (uintptr_t)ptr) {
-            /* Found it. */
-            alloced[i] = 0;
-            return;
+    size_t i = alloc_hash((uintptr_t)ptr);
+    while (alloced[i] != (uintptr_t)ptr) {
+        if (alloced[i] == 0) {
+            /* Failed to find it. */
+            error("Attempt to free pointer %p that was never malloced (called prior "
+                  "to %p)\n", ptr, ret_addr);
         }
+        i = (i + 1) & ALLOC_TABLE_MASK;
     }
-    /* Failed to find it. */
-    error("Attempt to free pointer %p that was never malloced (called prior "
-          "to %p)\n", ptr, ret_addr);
+
+    /* Found it. Shift back any following entries that would no longer be
+     * reachable from their hash over the hole we leave.
+     */
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & ALLOC_TABLE_MASK;
+        if (alloced[j] == 0) {
+            break;
+        }
+        size_t k = alloc_hash(alloced[j]);
+        /* Entry j can fill the hole at i if its home k is not cyclically in (i, j]. */
+        if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            alloced[i] = alloced[j];
+#ifdef CONFIG_LIBSEL4DEBUG_ALLOC_CALL_SITES
+            alloced_sites[i] = alloced_sites[j];
+#endif
+            i = j;
+        }
+    }
+    alloced[i] = 0;
+    alloced_count--;
+}
+
+#ifdef CONFIG_LIBSEL4DEBUG_ALLOC_CALL_SITES
+/* Scratch space for sorting call sites, as we can't malloc here. */
+static uintptr_t report_sites[ALLOC_TABLE_SIZE];
+
+static int compare_sites(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a;
+    uintptr_t y = *(const uintptr_t *)b;
+    return (x > y) - (x < y);
+}
+#endif
+
+void debug_alloc_report_leaks(void)
+{
+    printf("%zu live heap allocations\n", alloced_count);
+#ifdef CONFIG_LIBSEL4DEBUG_ALLOC_CALL_SITES
+    size_t n = 0;
+    for (size_t i = 0; i < ALLOC_TABLE_SIZE; i++) {
+        if (alloced[i] != 0) {
+            report_sites[n++] = (uintptr_t)alloced_sites[i];
+        }
+    }
+    qsort(report_sites, n, sizeof(report_sites[0]), compare_sites);
+    for (size_t i = 0; i < n;) {
+        size_t run = i;
+        while (run < n && report_sites[run] == report_sites[i]) {
+            run++;
+        }
+        printf("  %zu allocated prior to %p\n", run - i, (void *)report_sites[i]);
+        i = run;
+    }
+#endif
 }
 
 /* Wrapped functions that will be exported to us from libmuslc. */
@@ -223,10 +322,12 @@ void *__wrap_malloc(size_t size)
         return __real_malloc(size);
     }
 
+    void *ret = __builtin_extract_return_addr(__builtin_return_address(0));
+
     size_t new_size = adjust_size(size);
     void *ptr = __real_malloc(new_size);
     ptr = box(ptr, size);
-    track(ptr);
+    track(ptr, ret);
     return ptr;
 }
 
@@ -266,9 +367,11 @@ void *__wrap_calloc(size_t num, size_t size)
         new_num++;
     }
 
+    void *ret = __builtin_extract_return_addr(__builtin_return_address(0));
+
     void *ptr = __real_calloc(new_num, size);
     ptr = box(ptr, num * size);
-    track(ptr);
+    track(ptr, ret);
     return ptr;
 }
 
@@ -285,6 +388,6 @@ void *__wrap_realloc(void *ptr, size_t size)
     size_t new_size = adjust_size(size);
     ptr = __real_realloc(ptr, new_size);
     ptr = box(ptr, size);
-    track(ptr);
+    track(ptr, ret);
     return ptr;
 }
@@ -33,3 +33,13 @@ typedef size_t (*write_buf_fn)(void *data, size_t count);
  * similar to piping to /dev/null.
  */
 write_buf_fn sel4muslcsys_register_stdio_write_fn(write_buf_fn write_fn);
+
+/*
+ * Write out anything held in the calling thread's stdout/stderr buffer. This
+ * does nothing unless LibSel4MuslcSysStdioBufferBytes is nonzero.
+ *
+ * The buffer is flushed when a thread exits through exit() or pthread_exit(),
+ * or aborts. A thread that is stopped any other way, such as being suspended
+ * by another thread, must call this first or its buffered output is lost.
+ */
+void muslcsys_stdio_flush(void);
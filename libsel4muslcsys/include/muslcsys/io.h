@@ -56,3 +56,14 @@ typedef void const *(*muslcsys_cpio_get_file_fn_t)(void const *cpio_symbol,
 void muslcsys_install_cpio_interface(void const *cpio_symbol,
                                      unsigned long cpio_len,
                                      muslcsys_cpio_get_file_fn_t fn);
+
+/* Enumerate the files in the installed cpio archive. Opening files is served from
+ * an index built on first use when the default libcpio interface is installed;
+ * enumeration is only available in that case.
+ *
+ * Returns the number of files in the archive, or -1 if it cannot be indexed. */
+int muslcsys_cpio_num_files(void);
+
+/* Returns a pointer to the data of the n'th file in the archive and optionally its
+ * name and size, or NULL if n is out of range. */
+void const *muslcsys_cpio_get_file_by_index(int n, char const **name, unsigned long *size);
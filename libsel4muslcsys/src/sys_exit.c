@@ -11,9 +11,11 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <utils/util.h>
+#include "arch_stdio.h"
 
 static void sel4_abort(void)
 {
+    muslcsys_stdio_flush();
 #if defined(CONFIG_DEBUG_BUILD) && defined(CONFIG_LIB_SEL4_MUSLC_SYS_DEBUG_HALT)
     printf("seL4 root server abort()ed\n");
     seL4_DebugHalt();
@@ -23,6 +25,8 @@ static void sel4_abort(void)
 
 long sys_exit(va_list ap)
 {
+    /* this is how a thread exits, so nothing it buffered may be left behind */
+    muslcsys_stdio_flush();
     abort();
     return 0;
 }
@@ -61,6 +65,7 @@ long sys_tkill(va_list ap)
 
 long sys_exit_group(va_list ap)
 {
+    muslcsys_stdio_flush();
     ZF_LOGV("Ignoring call to %s", __FUNCTION__);
     return 0;
 }
@@ -27,6 +27,8 @@
 #include <bits/syscall.h>
 
 #include <sel4utils/util.h>
+#include <utils/util.h>
+#include <cpio/cpio.h>
 
 #include <muslcsys/io.h>
 #include "arch_stdio.h"
@@ -39,6 +41,30 @@ static void const *cpio_archive_symbol;
 static unsigned long cpio_archive_len;
 static muslcsys_cpio_get_file_fn_t cpio_get_file_impl;
 
+/* Index of the files in the cpio archive, built on first use if the installed
+ * interface is the default libcpio one. Entries are kept in archive order for
+ * enumeration, and looked up by name through an open addressing hash table
+ * that holds entry index + 1, with 0 marking an empty slot. Only one thread
+ * builds the index; others use the archive directly until it is built. */
+typedef struct cpio_index_entry {
+    char const *name;
+    char const *data;
+    unsigned long size;
+} cpio_index_entry_t;
+
+typedef enum {
+    CPIO_INDEX_UNBUILT,
+    CPIO_INDEX_BUILDING,
+    CPIO_INDEX_BUILT,
+    CPIO_INDEX_UNAVAILABLE,
+} cpio_index_state_t;
+
+static cpio_index_state_t cpio_index_state;
+static cpio_index_entry_t *cpio_index_entries;
+static size_t cpio_index_num_entries;
+static size_t *cpio_index_table;
+static size_t cpio_index_table_mask;
+
 /* We need to wrap this in the config to prevent linker errors */
 #ifdef CONFIG_LIB_SEL4_MUSLC_SYS_CPIO_FS
 extern char _cpio_archive[];
@@ -169,6 +195,194 @@ static size_t sys_platform_write(void *data, size_t count)
     return __arch_write(realdata, count);
 }
 
+/* FNV-1a */
+static size_t cpio_index_hash(char const *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Read the entry at *offset into entry and advance *offset to the next one.
+ * Returns false at the end of the archive. */
+static bool cpio_next_entry(unsigned long *offset, cpio_index_entry_t *entry)
+{
+    char const *archive = cpio_archive_symbol;
+    if (*offset >= cpio_archive_len) {
+        return false;
+    }
+    char const *data = cpio_get_entry(archive + *offset, cpio_archive_len - *offset, 0, &entry->name, &entry->size);
+    if (data == NULL) {
+        return false;
+    }
+    entry->data = data;
+    /* newc headers are 4 byte aligned in memory, as libcpio walks them */
+    *offset = ROUND_UP((uintptr_t) data + entry->size, 4) - (uintptr_t) archive;
+    return true;
+}
+
+/* Walk every entry in the archive, filling in entries if it is not NULL.
+ * Returns the number of entries. */
+static size_t cpio_index_walk(cpio_index_entry_t *entries)
+{
+    unsigned long offset = 0;
+    size_t count = 0;
+    cpio_index_entry_t entry;
+
+    while (cpio_next_entry(&offset, &entry)) {
+        if (entries != NULL) {
+            entries[count] = entry;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void cpio_index_insert(size_t entry)
+{
+    size_t slot = cpio_index_hash(cpio_index_entries[entry].name) & cpio_index_table_mask;
+    while (cpio_index_table[slot] != 0) {
+        /* keep the first of any duplicate names, as cpio_get_file does */
+        if (strcmp(cpio_index_entries[cpio_index_table[slot] - 1].name, cpio_index_entries[entry].name) == 0) {
+            return;
+        }
+        slot = (slot + 1) & cpio_index_table_mask;
+    }
+    cpio_index_table[slot] = entry + 1;
+}
+
+/* we can only index archives that we know the format of */
+static bool cpio_indexable(void)
+{
+    return cpio_archive_symbol != NULL && cpio_get_file_impl == (muslcsys_cpio_get_file_fn_t) cpio_get_file;
+}
+
+static cpio_index_state_t cpio_index_build(void)
+{
+    if (!cpio_indexable()) {
+        return CPIO_INDEX_UNAVAILABLE;
+    }
+
+    size_t count = cpio_index_walk(NULL);
+    size_t table_size = 1;
+    while (table_size < count * 2) {
+        table_size <<= 1;
+    }
+
+    cpio_index_entries = malloc(sizeof(cpio_index_entry_t) * MAX(count, 1));
+    cpio_index_table = calloc(table_size, sizeof(size_t));
+    if (cpio_index_entries == NULL || cpio_index_table == NULL) {
+        ZF_LOGW("Failed to allocate cpio index, falling back to linear lookup");
+        free(cpio_index_entries);
+        free(cpio_index_table);
+        cpio_index_entries = NULL;
+        cpio_index_table = NULL;
+        return CPIO_INDEX_UNAVAILABLE;
+    }
+
+    cpio_index_num_entries = cpio_index_walk(cpio_index_entries);
+    cpio_index_table_mask = table_size - 1;
+    for (size_t i = 0; i < cpio_index_num_entries; i++) {
+        cpio_index_insert(i);
+    }
+    return CPIO_INDEX_BUILT;
+}
+
+/* Build the index if nobody has yet. Returns CPIO_INDEX_BUILDING, rather than
+ * waiting, if another thread is building it */
+static cpio_index_state_t cpio_index_get(void)
+{
+    cpio_index_state_t state = __atomic_load_n(&cpio_index_state, __ATOMIC_ACQUIRE);
+    if (state == CPIO_INDEX_UNBUILT &&
+        __atomic_compare_exchange_n(&cpio_index_state, &state, CPIO_INDEX_BUILDING, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        state = cpio_index_build();
+        /* publish the index before the state that says it can be used */
+        __atomic_store_n(&cpio_index_state, state, __ATOMIC_RELEASE);
+    }
+    return state;
+}
+
+static cpio_index_entry_t *cpio_index_lookup(char const *name)
+{
+    size_t slot = cpio_index_hash(name) & cpio_index_table_mask;
+    while (cpio_index_table[slot] != 0) {
+        cpio_index_entry_t *entry = &cpio_index_entries[cpio_index_table[slot] - 1];
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & cpio_index_table_mask;
+    }
+    return NULL;
+}
+
+static char const *cpio_find_file(const char *pathname, unsigned long *size)
+{
+    if (cpio_index_get() == CPIO_INDEX_BUILT) {
+        cpio_index_entry_t *entry = cpio_index_lookup(pathname);
+        if (!entry && strncmp(pathname, "./", 2) == 0) {
+            entry = cpio_index_lookup(pathname + 2);
+        }
+        if (!entry) {
+            return NULL;
+        }
+        *size = entry->size;
+        return entry->data;
+    }
+
+    char const *file = cpio_get_file_impl(cpio_archive_symbol, cpio_archive_len, pathname, size);
+    if (!file && strncmp(pathname, "./", 2) == 0) {
+        file = cpio_get_file_impl(cpio_archive_symbol, cpio_archive_len, pathname + 2, size);
+    }
+    return file;
+}
+
+int muslcsys_cpio_num_files(void)
+{
+    switch (cpio_index_get()) {
+    case CPIO_INDEX_BUILT:
+        return cpio_index_num_entries;
+    case CPIO_INDEX_BUILDING:
+        return cpio_index_walk(NULL);
+    default:
+        return -1;
+    }
+}
+
+void const *muslcsys_cpio_get_file_by_index(int n, char const **name, unsigned long *size)
+{
+    cpio_index_state_t state = cpio_index_get();
+    if (n < 0 || state == CPIO_INDEX_UNAVAILABLE) {
+        return NULL;
+    }
+
+    cpio_index_entry_t entry;
+    if (state == CPIO_INDEX_BUILT) {
+        if ((size_t) n >= cpio_index_num_entries) {
+            return NULL;
+        }
+        entry = cpio_index_entries[n];
+    } else {
+        /* another thread is building the index, find the entry in the archive */
+        unsigned long offset = 0;
+        for (int i = 0; i <= n; i++) {
+            if (!cpio_next_entry(&offset, &entry)) {
+                return NULL;
+            }
+        }
+    }
+    if (name) {
+        *name = entry.name;
+    }
+    if (size) {
+        *size = entry.size;
+    }
+    return entry.data;
+}
+
 static long sys_open_impl(const char *pathname, int flags, mode_t mode)
 {
     /* mask out flags we can support */
@@ -183,10 +397,7 @@ static long sys_open_impl(const char *pathname, int flags, mode_t mode)
     long unsigned int size;
     char const *file = NULL;
     if (cpio_get_file_impl && cpio_archive_symbol) {
-        file = cpio_get_file_impl(cpio_archive_symbol, cpio_archive_len, pathname, &size);
-        if (!file && strncmp(pathname, "./", 2) == 0) {
-            file = cpio_get_file_impl(cpio_archive_symbol, cpio_archive_len, pathname + 2, &size);
-        }
+        file = cpio_find_file(pathname, &size);
     }
     if (!file) {
         ZF_LOGE("Failed to open file %s\n", pathname);
@@ -263,12 +474,49 @@ static write_buf_fn stdio_write = sys_platform_write;
 
 write_buf_fn sel4muslcsys_register_stdio_write_fn(write_buf_fn write_fn)
 {
+    /* anything already buffered belongs to the old function */
+    muslcsys_stdio_flush();
     write_buf_fn old = stdio_write;
     stdio_write = write_fn;
     return old;
 }
 
 
+#if CONFIG_LIB_SEL4_MUSLC_SYS_STDIO_BUFFER_BYTES > 0
+/* Per-thread buffer so that writes from different threads are not interleaved
+ * within a line, and no locking is needed */
+static __thread char stdio_buffer[CONFIG_LIB_SEL4_MUSLC_SYS_STDIO_BUFFER_BYTES];
+static __thread size_t stdio_buffer_fill;
+
+void muslcsys_stdio_flush(void)
+{
+    if (stdio_buffer_fill > 0 && stdio_write != NULL) {
+        stdio_write(stdio_buffer, stdio_buffer_fill);
+    }
+    stdio_buffer_fill = 0;
+}
+
+static void stdio_buffered_write(char *data, size_t count)
+{
+    if (count > sizeof(stdio_buffer) - stdio_buffer_fill) {
+        muslcsys_stdio_flush();
+        if (count >= sizeof(stdio_buffer)) {
+            /* too big to be worth buffering */
+            if (stdio_write != NULL) {
+                stdio_write(data, count);
+            }
+            return;
+        }
+    }
+    memcpy(&stdio_buffer[stdio_buffer_fill], data, count);
+    stdio_buffer_fill += count;
+}
+#else
+void muslcsys_stdio_flush(void)
+{
+}
+#endif /* CONFIG_LIB_SEL4_MUSLC_SYS_STDIO_BUFFER_BYTES > 0 */
+
 /* Writev syscall implementation for muslc. Only implemented for stdin and stdout. */
 long sys_writev(va_list ap)
 {
@@ -303,6 +551,18 @@ long sys_writev(va_list ap)
         if (stdio_write == NULL) {
             ZF_LOGD("No standard out function registered");
         }
+#if CONFIG_LIB_SEL4_MUSLC_SYS_STDIO_BUFFER_BYTES > 0
+        bool newline = false;
+        for (int i = 0; i < iovcnt; i++) {
+            stdio_buffered_write(iov[i].iov_base, iov[i].iov_len);
+            newline = newline || memchr(iov[i].iov_base, '\n', iov[i].iov_len) != NULL;
+            ret += iov[i].iov_len;
+        }
+        /* stdout is line buffered, stderr is not buffered beyond a single call */
+        if (newline || fildes == STDERR_FILENO) {
+            muslcsys_stdio_flush();
+        }
+#else
         for (int i = 0; i < iovcnt; i++) {
             if (stdio_write == NULL) {
                 ret += iov[i].iov_len;
@@ -310,6 +570,7 @@ long sys_writev(va_list ap)
                 ret += stdio_write(iov[i].iov_base, iov[i].iov_len);
             }
         }
+#endif
     } else {
         assert(!"Not implemented");
         return -EBADF;
@@ -532,4 +793,12 @@ void muslcsys_install_cpio_interface(void const *cpio_symbol, unsigned long cpio
     cpio_archive_symbol = cpio_symbol;
     cpio_archive_len = cpio_len;
     cpio_get_file_impl = fn;
+
+    /* the index is rebuilt lazily on the next open */
+    free(cpio_index_entries);
+    free(cpio_index_table);
+    cpio_index_entries = NULL;
+    cpio_index_table = NULL;
+    cpio_index_num_entries = 0;
+    cpio_index_state = CPIO_INDEX_UNBUILT;
 }
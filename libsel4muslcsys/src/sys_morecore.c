@@ -15,12 +15,60 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
 
 #include <vspace/vspace.h>
 
 #include <sel4utils/util.h>
 #include <sel4utils/mapping.h>
 
+#include <muslcsys/io.h>
+
+long sys_mmap_impl(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+/* Map a file from the cpio archive. As the archive is already mapped read-only
+ * in our address space, a private read-only mapping of a page aligned file
+ * can be served with a pointer straight into the archive. Note that in this
+ * case any bytes past the end of the file in the last page are not zero, but
+ * whatever follows the file in the archive.
+ *
+ * A pointer returned by mmap must be page aligned, so if the file data does
+ * not start on a page boundary in the archive it is copied into anonymous
+ * memory instead. */
+static long sys_mmap_file(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    if (!valid_fd(fd)) {
+        return -EBADF;
+    }
+    muslcsys_fd_t *muslc_fd = get_fd_struct(fd);
+    if (muslc_fd->filetype != FILE_TYPE_CPIO) {
+        assert(!"not implemented");
+        return -ENODEV;
+    }
+    if ((prot & PROT_WRITE) || !(flags & MAP_PRIVATE) || (flags & MAP_FIXED)) {
+        ZF_LOGE("Only private read-only mappings of files are supported");
+        return -EACCES;
+    }
+    cpio_file_data_t *cpio_fd = muslc_fd->data;
+    if (!IS_ALIGNED_4K(offset) || offset < 0 || offset > cpio_fd->size) {
+        return -EINVAL;
+    }
+
+    char const *start = cpio_fd->start + offset;
+    if (IS_ALIGNED_4K((uintptr_t) start)) {
+        return (long) start;
+    }
+
+    long ret = sys_mmap_impl(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret < 0 && ret > -4096) {
+        return ret;
+    }
+    if (ret != 0) {
+        memcpy((void *) ret, start, MIN(length, cpio_fd->size - offset));
+    }
+    return ret;
+}
+
 /* If we have a nonzero static morecore then we are just doing dodgy hacky morecore */
 #if CONFIG_LIB_SEL4_MUSLC_SYS_MORECORE_BYTES > 0
 
@@ -76,8 +124,7 @@ long sys_mmap_impl(void *addr, size_t length, int prot, int flags, int fd, off_t
         morecore_top -= length;
         return morecore_top;
     }
-    assert(!"not implemented");
-    return -ENOMEM;
+    return sys_mmap_file(addr, length, prot, flags, fd, offset);
 }
 
 long sys_mremap(va_list ap)
@@ -86,6 +133,13 @@ long sys_mremap(va_list ap)
     return -ENOMEM;
 }
 
+static long sys_munmap_impl(void *addr, size_t length)
+{
+    ZF_LOGE("%s is unsupported. This may have been called due to a "
+            "large malloc'd region being free'd.", __func__);
+    return 0;
+}
+
 #else
 
 /* dynamic morecore based on a vspace. These need to be defined somewhere (probably in the
@@ -111,6 +165,55 @@ uintptr_t morecore_top = 0;
 
 static uintptr_t brk_start;
 
+/* Anonymous regions handed out by the dynamic mmap, so that munmap and mremap
+ * know which pages they own. This is a fixed size table as these calls are
+ * made from within malloc and free. */
+#define MMAP_MAX_REGIONS 1024
+
+typedef struct mmap_region {
+    uintptr_t start;
+    size_t pages;
+} mmap_region_t;
+
+static mmap_region_t mmap_regions[MMAP_MAX_REGIONS];
+static int mmap_num_regions;
+
+/* Callers check mmap_regions_full before changing any mappings, so this cannot fail */
+static void mmap_region_add(uintptr_t start, size_t pages)
+{
+    assert(mmap_num_regions < MMAP_MAX_REGIONS);
+    mmap_regions[mmap_num_regions] = (mmap_region_t) {
+        .start = start, .pages = pages
+    };
+    mmap_num_regions++;
+}
+
+static bool mmap_regions_full(void)
+{
+    if (mmap_num_regions == MMAP_MAX_REGIONS) {
+        ZF_LOGE("Too many mmap regions, at most %d can be tracked", MMAP_MAX_REGIONS);
+        return true;
+    }
+    return false;
+}
+
+static void mmap_region_remove(int index)
+{
+    mmap_num_regions--;
+    mmap_regions[index] = mmap_regions[mmap_num_regions];
+}
+
+/* Returns the index of the region starting at start, or -1 */
+static int mmap_region_find(uintptr_t start)
+{
+    for (int i = 0; i < mmap_num_regions; i++) {
+        if (mmap_regions[i].start == start) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static void init_morecore_region(void)
 {
     if (morecore_base == 0) {
@@ -141,6 +244,96 @@ static long sys_brk_static(va_list ap)
     return ret;
 }
 
+/* The dynamic brk region is mapped as a stack of segments, each a run of
+ * frames of one size, so that it can be shrunk again from the top. */
+#define BRK_MAX_SEGMENTS 256
+
+typedef struct brk_segment {
+    uintptr_t start;
+    size_t num_pages;
+    size_t size_bits;
+} brk_segment_t;
+
+static brk_segment_t brk_segments[BRK_MAX_SEGMENTS];
+static int brk_num_segments;
+/* end of the mapped part of the brk region, which may be beyond brk_start */
+static uintptr_t brk_mapped_top;
+
+/* Map num_pages frames of size_bits at the top of the brk region in one call */
+static int brk_map(size_t num_pages, size_t size_bits)
+{
+    brk_segment_t *top = brk_num_segments ? &brk_segments[brk_num_segments - 1] : NULL;
+    bool coalesce = top != NULL && top->size_bits == size_bits;
+    if (!coalesce && brk_num_segments == BRK_MAX_SEGMENTS) {
+        ZF_LOGE("Too many brk segments");
+        return -1;
+    }
+
+    int error = vspace_new_pages_at_vaddr(muslc_this_vspace, (void *) brk_mapped_top, num_pages,
+                                          size_bits, muslc_brk_reservation);
+    if (error) {
+        return error;
+    }
+
+    if (coalesce) {
+        top->num_pages += num_pages;
+    } else {
+        brk_segments[brk_num_segments] = (brk_segment_t) {
+            .start = brk_mapped_top, .num_pages = num_pages, .size_bits = size_bits
+        };
+        brk_num_segments++;
+    }
+    brk_mapped_top += num_pages * BIT(size_bits);
+    return 0;
+}
+
+/* Grow the mapped part of the brk region to target, which must be 4K aligned */
+static int brk_grow(uintptr_t target)
+{
+    uintptr_t boundary = ROUND_UP(brk_mapped_top, BIT(seL4_LargePageBits));
+    /* Large pages need one segment for the 4K pages up to the boundary and one
+     * for themselves, while keeping a slot spare for 4K pages after them */
+    if (config_set(CONFIG_LIB_SEL4_MUSLC_SYS_BRK_LARGE_PAGES) &&
+        target > boundary && target - boundary >= BIT(seL4_LargePageBits) &&
+        brk_num_segments + 3 <= BRK_MAX_SEGMENTS) {
+        if (boundary > brk_mapped_top) {
+            int error = brk_map((boundary - brk_mapped_top) / PAGE_SIZE_4K, seL4_PageBits);
+            if (error) {
+                return error;
+            }
+        }
+        size_t large_pages = (target - boundary) >> seL4_LargePageBits;
+        if (brk_map(large_pages, seL4_LargePageBits) != 0) {
+            ZF_LOGD("Failed to map large pages for brk, falling back to 4K pages");
+        }
+    }
+    if (target > brk_mapped_top) {
+        return brk_map((target - brk_mapped_top) / PAGE_SIZE_4K, seL4_PageBits);
+    }
+    return 0;
+}
+
+/* Unmap and free any whole frames in the brk region above keep */
+static void brk_shrink(uintptr_t keep)
+{
+    while (brk_num_segments > 0 && brk_mapped_top > keep) {
+        brk_segment_t *top = &brk_segments[brk_num_segments - 1];
+        uintptr_t lo = MAX(top->start, ROUND_UP(keep, BIT(top->size_bits)));
+        if (lo >= brk_mapped_top) {
+            break;
+        }
+        size_t num_pages = (brk_mapped_top - lo) >> top->size_bits;
+        vspace_unmap_pages(muslc_this_vspace, (void *) lo, num_pages, top->size_bits, VSPACE_FREE);
+        top->num_pages -= num_pages;
+        brk_mapped_top = lo;
+        if (top->num_pages == 0) {
+            brk_num_segments--;
+        } else {
+            break;
+        }
+    }
+}
+
 static long sys_brk_dynamic(va_list ap)
 {
 
@@ -152,21 +345,31 @@ static long sys_brk_dynamic(va_list ap)
         return 0;
     }
 
+    if (brk_start == 0) {
+        brk_start = (uintptr_t)muslc_brk_reservation_start;
+        brk_mapped_top = brk_start;
+    }
+
     /*if the newbrk is 0, return the bottom of the heap*/
     if (newbrk == 0) {
-        brk_start = (uintptr_t)muslc_brk_reservation_start;
-        ret = brk_start;
+        ret = (uintptr_t)muslc_brk_reservation_start;
+    } else if (newbrk < (uintptr_t)muslc_brk_reservation_start) {
+        ret = 0;
     } else {
-        /* try and map pages until this point */
-        while (brk_start < newbrk) {
-            int error = vspace_new_pages_at_vaddr(muslc_this_vspace, (void *) brk_start, 1,
-                                                  seL4_PageBits, muslc_brk_reservation);
-            if (error) {
-                ZF_LOGE("Mapping new pages to extend brk region failed\n");
-                return 0;
+        uintptr_t target = ROUND_UP(newbrk, PAGE_SIZE_4K);
+        uintptr_t slack = ROUND_UP(CONFIG_LIB_SEL4_MUSLC_SYS_BRK_SLACK_BYTES, PAGE_SIZE_4K);
+        if (target > brk_mapped_top) {
+            /* try and map pages until this point, with some slack if we can */
+            if (slack == 0 || brk_grow(target + slack) != 0) {
+                if (brk_grow(target) != 0) {
+                    ZF_LOGE("Mapping new pages to extend brk region failed\n");
+                    return 0;
+                }
             }
-            brk_start += PAGE_SIZE_4K;
+        } else if (target < brk_start) {
+            brk_shrink(target + slack);
         }
+        brk_start = target;
         ret = brk_start;
     }
     return ret;
@@ -223,11 +426,18 @@ static long sys_mmap_impl_dynamic(void *addr, size_t length, int prot, int flags
         return 0;
     }
     if (flags & MAP_ANONYMOUS) {
+        /* an untracked region could never be unmapped */
+        if (mmap_regions_full()) {
+            return -ENOMEM;
+        }
         /* determine how many pages we need */
         uint32_t pages = BYTES_TO_4K_PAGES(length);
         void *ret = vspace_new_pages(muslc_this_vspace, seL4_AllRights, pages, seL4_PageBits);
         ZF_LOGF_IF((((uintptr_t)ret) % 0x1000) != 0, "return address: 0x%"PRIxPTR" requires alignment: 0x%x ", (uintptr_t)ret,
                    0x1000);
+        if (ret != NULL) {
+            mmap_region_add((uintptr_t) ret, pages);
+        }
         return (long)ret;
     }
     assert(!"not implemented");
@@ -240,6 +450,9 @@ long sys_mmap_impl(void *addr, size_t length, int prot, int flags, int fd, off_t
         // It is an error to request a length 0 in most mmap specs.
         return -EINVAL;
     }
+    if (!(flags & MAP_ANONYMOUS)) {
+        return sys_mmap_file(addr, length, prot, flags, fd, offset);
+    }
     if (morecore_area != NULL) {
         return sys_mmap_impl_static(addr, length, prot, flags, fd, offset);
     } else if (muslc_this_vspace != NULL) {
@@ -251,53 +464,70 @@ long sys_mmap_impl(void *addr, size_t length, int prot, int flags, int fd, off_t
     }
 }
 
-static long sys_mremap_dynamic(va_list ap)
-{
+/* Number of pages moved per call to vspace_map_pages_at_vaddr by mremap. This bounds
+ * the stack used for their caps, however large the region being moved is. */
+#define MREMAP_BATCH_PAGES 64
 
-    void *old_address = va_arg(ap, void *);
-    size_t old_size = va_arg(ap, size_t);
-    size_t new_size = va_arg(ap, size_t);
-    int flags = va_arg(ap, int);
-    UNUSED void *new_address_arg;
-
-    assert(flags == MREMAP_MAYMOVE);
-    assert(IS_ALIGNED_4K(old_size));
-    assert(IS_ALIGNED_4K((uintptr_t) old_address));
-    assert(IS_ALIGNED_4K(new_size));
-    /* we currently only support remaping to size >= original */
-    assert(new_size >= old_size);
-
-    if (flags & MREMAP_FIXED) {
-        new_address_arg = va_arg(ap, void *);
-    }
-
-    /* first find all the old caps */
-    int num_pages = old_size >> seL4_PageBits;
-    seL4_CPtr caps[num_pages];
-    uintptr_t cookies[num_pages];
-    int i;
-    for (i = 0; i < num_pages; i++) {
-        void *vaddr = old_address + i * BIT(seL4_PageBits);
+/* Move num_pages mapped pages (at most MREMAP_BATCH_PAGES) from one address to another
+ * in the given reservation. If they cannot be mapped at the new address they are mapped
+ * back where they were. */
+static int mremap_move_batch(void *from, void *to, int num_pages, reservation_t reservation)
+{
+    seL4_CPtr caps[MREMAP_BATCH_PAGES];
+    uintptr_t cookies[MREMAP_BATCH_PAGES];
+    assert(num_pages <= MREMAP_BATCH_PAGES);
+    for (int i = 0; i < num_pages; i++) {
+        void *vaddr = from + i * PAGE_SIZE_4K;
         caps[i] = vspace_get_cap(muslc_this_vspace, vaddr);
         cookies[i] = vspace_get_cookie(muslc_this_vspace, vaddr);
     }
-    /* unmap the previous mapping */
-    vspace_unmap_pages(muslc_this_vspace, old_address, num_pages, seL4_PageBits, VSPACE_PRESERVE);
+    vspace_unmap_pages(muslc_this_vspace, from, num_pages, seL4_PageBits, VSPACE_PRESERVE);
+    int error = vspace_map_pages_at_vaddr(muslc_this_vspace, caps, cookies, to, num_pages, seL4_PageBits,
+                                          reservation);
+    if (error) {
+        reservation_t restore = vspace_reserve_range_at(muslc_this_vspace, from, num_pages * PAGE_SIZE_4K,
+                                                        seL4_AllRights, 1);
+        assert(restore.res);
+        UNUSED int err = vspace_map_pages_at_vaddr(muslc_this_vspace, caps, cookies, from, num_pages,
+                                                   seL4_PageBits, restore);
+        assert(!err);
+        vspace_free_reservation(muslc_this_vspace, restore);
+    }
+    return error;
+}
+
+/* Move the first num_pages pages mapped at from to to, a batch at a time. Returns the
+ * number of pages moved, which is less than num_pages if a batch could not be mapped. */
+static int mremap_move_pages(void *from, void *to, int num_pages, reservation_t reservation)
+{
+    int moved = 0;
+    while (moved < num_pages) {
+        int batch = MIN(num_pages - moved, MREMAP_BATCH_PAGES);
+        if (mremap_move_batch(from + moved * PAGE_SIZE_4K, to + moved * PAGE_SIZE_4K, batch, reservation)) {
+            break;
+        }
+        moved += batch;
+    }
+    return moved;
+}
+
+/* Move a region to a new reservation of new_pages, remapping the existing frames
+ * rather than copying them and creating new frames for the remainder */
+static long mremap_move(void *old_address, int num_pages, int new_pages)
+{
     /* reserve a new region */
     int error;
     void *new_address;
-    int new_pages = new_size >> seL4_PageBits;
     reservation_t reservation = vspace_reserve_range(muslc_this_vspace, new_pages * PAGE_SIZE_4K, seL4_AllRights, 1,
                                                      &new_address);
     if (!reservation.res) {
         ZF_LOGE("Failed to make reservation for remap\n");
-        goto restore;
+        return -ENOMEM;
     }
-    /* map all the existing pages into the reservation */
-    error = vspace_map_pages_at_vaddr(muslc_this_vspace, caps, cookies, new_address, num_pages, seL4_PageBits, reservation);
-    if (error) {
+    /* move all the existing pages into the reservation */
+    int moved = mremap_move_pages(old_address, new_address, num_pages, reservation);
+    if (moved < num_pages) {
         ZF_LOGE("Mapping existing pages into new reservation failed\n");
-        vspace_free_reservation(muslc_this_vspace, reservation);
         goto restore;
     }
     /* create any new pages */
@@ -305,29 +535,160 @@ static long sys_mremap_dynamic(va_list ap)
                                       seL4_PageBits, reservation);
     if (error) {
         ZF_LOGE("Creating new pages for remap region failed\n");
-        vspace_unmap_pages(muslc_this_vspace, new_address, num_pages, seL4_PageBits, VSPACE_PRESERVE);
-        vspace_free_reservation(muslc_this_vspace, reservation);
         goto restore;
     }
     /* free the reservation book keeping */
     vspace_free_reservation(muslc_this_vspace, reservation);
     return (long)new_address;
 restore:
-    /* try and recreate the original mapping */
-    reservation = vspace_reserve_range_at(muslc_this_vspace, old_address, num_pages * PAGE_SIZE_4K, seL4_AllRights, 1);
-    assert(reservation.res);
-    error = vspace_map_pages_at_vaddr(muslc_this_vspace, caps, cookies, old_address,
-                                      num_pages, seL4_PageBits, reservation);
-    assert(!error);
+    /* move the pages that were moved back to the original mapping */
+    if (moved > 0) {
+        reservation_t old_reservation = vspace_reserve_range_at(muslc_this_vspace, old_address,
+                                                                moved * PAGE_SIZE_4K, seL4_AllRights, 1);
+        assert(old_reservation.res);
+        UNUSED int restored = mremap_move_pages(new_address, old_address, moved, old_reservation);
+        assert(restored == moved);
+        vspace_free_reservation(muslc_this_vspace, old_reservation);
+    }
+    vspace_free_reservation(muslc_this_vspace, reservation);
     return -ENOMEM;
 }
 
+/* Try to extend a region in place, which is possible if the range following it is free */
+static int mremap_grow_in_place(void *old_address, int num_pages, int new_pages)
+{
+    void *tail = old_address + num_pages * PAGE_SIZE_4K;
+    size_t tail_pages = new_pages - num_pages;
+    reservation_t reservation = vspace_reserve_range_at(muslc_this_vspace, tail, tail_pages * PAGE_SIZE_4K,
+                                                        seL4_AllRights, 1);
+    if (!reservation.res) {
+        return -1;
+    }
+    int error = vspace_new_pages_at_vaddr(muslc_this_vspace, tail, tail_pages, seL4_PageBits, reservation);
+    vspace_free_reservation(muslc_this_vspace, reservation);
+    return error;
+}
+
+static long sys_mremap_dynamic(va_list ap)
+{
+
+    void *old_address = va_arg(ap, void *);
+    size_t old_size = va_arg(ap, size_t);
+    size_t new_size = va_arg(ap, size_t);
+    int flags = va_arg(ap, int);
+
+    if (flags & MREMAP_FIXED) {
+        ZF_LOGE("MREMAP_FIXED is not supported");
+        return -EINVAL;
+    }
+    if (!IS_ALIGNED_4K((uintptr_t) old_address) || new_size == 0) {
+        return -EINVAL;
+    }
+
+    int num_pages = BYTES_TO_4K_PAGES(old_size);
+    int new_pages = BYTES_TO_4K_PAGES(new_size);
+    int region = mmap_region_find((uintptr_t) old_address);
+    if (region == -1 || mmap_regions[region].pages != num_pages) {
+        ZF_LOGE("Can only remap whole regions returned by mmap");
+        return -EINVAL;
+    }
+
+    if (new_pages == num_pages) {
+        return (long) old_address;
+    }
+
+    if (new_pages < num_pages) {
+        vspace_unmap_pages(muslc_this_vspace, old_address + new_pages * PAGE_SIZE_4K, num_pages - new_pages,
+                           seL4_PageBits, VSPACE_FREE);
+        mmap_regions[region].pages = new_pages;
+        return (long) old_address;
+    }
+
+    if (mremap_grow_in_place(old_address, num_pages, new_pages) == 0) {
+        mmap_regions[region].pages = new_pages;
+        return (long) old_address;
+    }
+
+    if (!(flags & MREMAP_MAYMOVE)) {
+        return -ENOMEM;
+    }
+
+    long new_address = mremap_move(old_address, num_pages, new_pages);
+    if (new_address >= 0 || new_address <= -4096) {
+        mmap_regions[region].start = (uintptr_t) new_address;
+        mmap_regions[region].pages = new_pages;
+    }
+    return new_address;
+}
+
 static long sys_mremap_static(va_list ap)
 {
     assert(!"not implemented");
     return -ENOMEM;
 }
 
+static long sys_munmap_dynamic(void *addr, size_t length)
+{
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t end = start + BYTES_TO_4K_PAGES(length) * PAGE_SIZE_4K;
+
+    if (!IS_ALIGNED_4K(start)) {
+        return -EINVAL;
+    }
+
+    /* regions are disjoint, so at most one is split in two. Fail before unmapping
+     * anything if there is no room to track its tail */
+    for (int i = 0; i < mmap_num_regions; i++) {
+        uintptr_t region_end = mmap_regions[i].start + mmap_regions[i].pages * PAGE_SIZE_4K;
+        if (mmap_regions[i].start < start && end < region_end && mmap_regions_full()) {
+            return -ENOMEM;
+        }
+    }
+
+    /* Unmap the intersection of [start, end) with each region, trimming or
+     * splitting regions that are only partially unmapped. Addresses that are
+     * not in any region (such as files mapped directly out of the cpio
+     * archive) are left alone. */
+    for (int i = 0; i < mmap_num_regions;) {
+        mmap_region_t *region = &mmap_regions[i];
+        uintptr_t region_end = region->start + region->pages * PAGE_SIZE_4K;
+        uintptr_t lo = MAX(start, region->start);
+        uintptr_t hi = MIN(end, region_end);
+        if (lo >= hi) {
+            i++;
+            continue;
+        }
+
+        vspace_unmap_pages(muslc_this_vspace, (void *) lo, (hi - lo) / PAGE_SIZE_4K, seL4_PageBits, VSPACE_FREE);
+        if (lo == region->start && hi == region_end) {
+            /* the last region is swapped into this slot, so don't advance */
+            mmap_region_remove(i);
+            continue;
+        }
+        if (lo == region->start) {
+            region->start = hi;
+            region->pages = (region_end - hi) / PAGE_SIZE_4K;
+        } else if (hi == region_end) {
+            region->pages = (lo - region->start) / PAGE_SIZE_4K;
+        } else {
+            region->pages = (lo - region->start) / PAGE_SIZE_4K;
+            mmap_region_add(hi, (region_end - hi) / PAGE_SIZE_4K);
+        }
+        i++;
+    }
+    return 0;
+}
+
+static long sys_munmap_impl(void *addr, size_t length)
+{
+    if (muslc_this_vspace != NULL && morecore_area == NULL) {
+        return sys_munmap_dynamic(addr, length);
+    }
+    ZF_LOGE("%s is unsupported. This may have been called due to a "
+            "large malloc'd region being free'd.", __func__);
+    return 0;
+}
+
 long sys_mremap(va_list ap)
 {
     if (morecore_area != NULL) {
@@ -376,7 +737,7 @@ long sys_mmap2(va_list ap)
 
 long sys_munmap(va_list ap)
 {
-    ZF_LOGE("%s is unsupported. This may have been called due to a "
-            "large malloc'd region being free'd.", __func__);
-    return 0;
+    void *addr = va_arg(ap, void *);
+    size_t length = va_arg(ap, size_t);
+    return sys_munmap_impl(addr, length);
 }
@@ -30,6 +30,10 @@
  * Creates a new implementation of the platsupport io_mapper interface using a
  * provided simple, vspace and vka
  *
+ * Mappings are reference counted: a request that is covered by an existing
+ * mapping with the same cacheability is served from that mapping, which is
+ * only unmapped once every request it served has been unmapped.
+ *
  * @param vspace VSpace interface to use for mapping
  * @param vka VKA interface for allocating physical frames, and any extra objects or cslots
  * @param io_mapper Interface to fill in
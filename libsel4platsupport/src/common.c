@@ -311,10 +311,22 @@ WEAK
 #endif
 __arch_write(char *data, size_t count)
 {
+#ifdef CONFIG_LIB_SEL4_MUSLC_SYS_ARCH_PUTCHAR_WEAK
+    /* __arch_putchar may have been overridden, so keep going through it */
     for (size_t i = 0; i < count; i++) {
         __arch_putchar(data[i]);
     }
     return count;
+#else
+    /* This deliberately skips the per character __arch_putchar path. The
+     * console is still only reached through its ps_chardevice_t, and
+     * ps_cdev_putchar is a one byte ps_cdev_write, so the device sees the
+     * same bytes, just in fewer calls. */
+    if (setup_status != SETUP_COMPLETE) {
+        __serial_setup();
+    }
+    return __plat_write(data, count);
+#endif
 }
 
 int __arch_getchar(void)
@@ -22,10 +22,13 @@
 #include <stdlib.h>
 
 typedef struct io_mapping {
-    /* address we returned to the user */
-    void *returned_addr;
     /* base address of the mapping with respect to the vspace */
     void *mapped_addr;
+    /* physical address of the first frame */
+    uintptr_t paddr;
+    bool cached;
+    /* number of outstanding map calls served by this mapping */
+    size_t refcount;
     size_t num_pages;
     size_t page_size;
     size_t page_size_bits;
@@ -36,10 +39,47 @@ typedef struct io_mapping {
     struct io_mapping *next, *prev;
 } io_mapping_t;
 
+typedef struct io_request io_request_t;
+
+/* An address returned to the user, which is what unmap is called with. A single
+ * mapping may be shared by any number of handles when requests overlap. */
+typedef struct io_handle {
+    void *returned_addr;
+    io_mapping_t *mapping;
+    /* number of times this address was returned and not yet unmapped */
+    size_t refcount;
+    /* requests that returned this address */
+    io_request_t *requests;
+    struct io_handle *hash_next;
+} io_handle_t;
+
+/* A map request that has been served, so that repeating it finds its handle
+ * without searching the mapping list. Lives as long as its handle. */
+struct io_request {
+    uintptr_t paddr;
+    size_t size;
+    bool cached;
+    io_handle_t *handle;
+    struct io_request *hash_next;
+    /* next request served by the same handle */
+    struct io_request *handle_next;
+};
+
+#define IO_MAPPER_INITIAL_BUCKETS 16
+
 typedef struct sel4platsupport_io_mapper_cookie {
     vspace_t *vspace;
     vka_t *vka;
+    /* all live mappings */
     io_mapping_t *head;
+    /* handles hashed by returned address */
+    io_handle_t **buckets;
+    size_t num_buckets;
+    size_t num_handles;
+    /* requests hashed by paddr, size and cacheability */
+    io_request_t **request_buckets;
+    size_t num_request_buckets;
+    size_t num_requests;
 } sel4platsupport_io_mapper_cookie_t;
 
 static void free_node(io_mapping_t *node)
@@ -103,11 +143,14 @@ static void insert_node(sel4platsupport_io_mapper_cookie_t *io_mapper, io_mappin
     io_mapper->head = node;
 }
 
-static io_mapping_t *find_node(sel4platsupport_io_mapper_cookie_t *io_mapper, void *returned_addr)
+/* Find an existing mapping with the same attributes that covers [paddr, paddr + size) */
+static io_mapping_t *find_covering_node(sel4platsupport_io_mapper_cookie_t *io_mapper, uintptr_t paddr,
+                                        size_t size, bool cached)
 {
     io_mapping_t *current;
     for (current = io_mapper->head; current; current = current->next) {
-        if (current->returned_addr == returned_addr) {
+        uintptr_t end = current->paddr + current->num_pages * BIT(current->page_size_bits);
+        if (current->cached == cached && paddr >= current->paddr && paddr + size <= end) {
             return current;
         }
     }
@@ -127,8 +170,163 @@ static void remove_node(sel4platsupport_io_mapper_cookie_t *io_mapper, io_mappin
     }
 }
 
-static void *sel4platsupport_map_paddr_with_page_size(sel4platsupport_io_mapper_cookie_t *io_mapper, uintptr_t paddr,
-                                                      size_t size, size_t page_size_bits, bool cached)
+static inline size_t hash_bucket(size_t num_buckets, uint64_t key)
+{
+    /* Fibonacci hashing; buckets is a power of two */
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash >> 32) & (num_buckets - 1);
+}
+
+static inline size_t handle_bucket(size_t num_buckets, void *returned_addr)
+{
+    return hash_bucket(num_buckets, (uintptr_t) returned_addr);
+}
+
+static inline size_t request_bucket(size_t num_buckets, uintptr_t paddr, size_t size, bool cached)
+{
+    return hash_bucket(num_buckets, ((uint64_t) paddr * 31 + size) * 2 + cached);
+}
+
+static io_handle_t **find_handle(sel4platsupport_io_mapper_cookie_t *io_mapper, void *returned_addr)
+{
+    io_handle_t **handle = &io_mapper->buckets[handle_bucket(io_mapper->num_buckets, returned_addr)];
+    while (*handle && (*handle)->returned_addr != returned_addr) {
+        handle = &(*handle)->hash_next;
+    }
+    return handle;
+}
+
+static void grow_handles(sel4platsupport_io_mapper_cookie_t *io_mapper)
+{
+    size_t num_buckets = io_mapper->num_buckets * 2;
+    io_handle_t **buckets = calloc(num_buckets, sizeof(io_handle_t *));
+    if (!buckets) {
+        /* keep using the existing table, at the cost of longer chains */
+        return;
+    }
+    for (size_t i = 0; i < io_mapper->num_buckets; i++) {
+        io_handle_t *handle = io_mapper->buckets[i];
+        while (handle) {
+            io_handle_t *next = handle->hash_next;
+            size_t bucket = handle_bucket(num_buckets, handle->returned_addr);
+            handle->hash_next = buckets[bucket];
+            buckets[bucket] = handle;
+            handle = next;
+        }
+    }
+    free(io_mapper->buckets);
+    io_mapper->buckets = buckets;
+    io_mapper->num_buckets = num_buckets;
+}
+
+static io_request_t **find_request(sel4platsupport_io_mapper_cookie_t *io_mapper, uintptr_t paddr, size_t size,
+                                   bool cached)
+{
+    io_request_t **request = &io_mapper->request_buckets[request_bucket(io_mapper->num_request_buckets, paddr, size,
+                                                                       cached)];
+    while (*request && ((*request)->paddr != paddr || (*request)->size != size || (*request)->cached != cached)) {
+        request = &(*request)->hash_next;
+    }
+    return request;
+}
+
+static void grow_requests(sel4platsupport_io_mapper_cookie_t *io_mapper)
+{
+    size_t num_buckets = io_mapper->num_request_buckets * 2;
+    io_request_t **buckets = calloc(num_buckets, sizeof(io_request_t *));
+    if (!buckets) {
+        /* keep using the existing table, at the cost of longer chains */
+        return;
+    }
+    for (size_t i = 0; i < io_mapper->num_request_buckets; i++) {
+        io_request_t *request = io_mapper->request_buckets[i];
+        while (request) {
+            io_request_t *next = request->hash_next;
+            size_t bucket = request_bucket(num_buckets, request->paddr, request->size, request->cached);
+            request->hash_next = buckets[bucket];
+            buckets[bucket] = request;
+            request = next;
+        }
+    }
+    free(io_mapper->request_buckets);
+    io_mapper->request_buckets = buckets;
+    io_mapper->num_request_buckets = num_buckets;
+}
+
+/* Remember that a request was served by handle. This is only an optimisation,
+ * so running out of memory is not an error. */
+static void add_request(sel4platsupport_io_mapper_cookie_t *io_mapper, io_handle_t *handle, uintptr_t paddr,
+                        size_t size, bool cached)
+{
+    io_request_t **slot = find_request(io_mapper, paddr, size, cached);
+    if (*slot) {
+        return;
+    }
+    io_request_t *request = malloc(sizeof(io_request_t));
+    if (!request) {
+        return;
+    }
+    *request = (io_request_t) {
+        .paddr = paddr, .size = size, .cached = cached, .handle = handle,
+        .hash_next = NULL, .handle_next = handle->requests
+    };
+    *slot = request;
+    handle->requests = request;
+    io_mapper->num_requests++;
+    if (io_mapper->num_requests > io_mapper->num_request_buckets) {
+        grow_requests(io_mapper);
+    }
+}
+
+/* Forget every request served by a handle that is being freed */
+static void remove_requests(sel4platsupport_io_mapper_cookie_t *io_mapper, io_handle_t *handle)
+{
+    while (handle->requests) {
+        io_request_t *request = handle->requests;
+        handle->requests = request->handle_next;
+        io_request_t **slot = &io_mapper->request_buckets[request_bucket(io_mapper->num_request_buckets,
+                                                                        request->paddr, request->size,
+                                                                        request->cached)];
+        while (*slot != request) {
+            slot = &(*slot)->hash_next;
+        }
+        *slot = request->hash_next;
+        io_mapper->num_requests--;
+        free(request);
+    }
+}
+
+/* Record that returned_addr has been handed out for mapping */
+static io_handle_t *add_handle(sel4platsupport_io_mapper_cookie_t *io_mapper, io_mapping_t *mapping,
+                               void *returned_addr)
+{
+    io_handle_t **slot = find_handle(io_mapper, returned_addr);
+    io_handle_t *handle = *slot;
+    if (handle) {
+        assert(handle->mapping == mapping);
+        handle->refcount++;
+    } else {
+        handle = malloc(sizeof(io_handle_t));
+        if (!handle) {
+            ZF_LOGE("Failed to allocate handle");
+            return NULL;
+        }
+        *handle = (io_handle_t) {
+            .returned_addr = returned_addr, .mapping = mapping, .refcount = 1, .requests = NULL, .hash_next = NULL
+        };
+        *slot = handle;
+        io_mapper->num_handles++;
+        if (io_mapper->num_handles > io_mapper->num_buckets) {
+            grow_handles(io_mapper);
+        }
+    }
+    mapping->refcount++;
+    return handle;
+}
+
+static io_handle_t *sel4platsupport_map_paddr_with_page_size(sel4platsupport_io_mapper_cookie_t *io_mapper,
+                                                             uintptr_t paddr, size_t size, size_t page_size_bits,
+                                                             bool cached)
 {
 
     vka_t *vka = io_mapper->vka;
@@ -147,6 +345,8 @@ static void *sel4platsupport_map_paddr_with_page_size(sel4platsupport_io_mapper_
         return NULL;
     }
     mapping->page_size_bits = page_size_bits;
+    mapping->paddr = start;
+    mapping->cached = cached;
 
     seL4_Word type = kobject_get_type(KOBJECT_FRAME, mapping->page_size_bits);
     /* allocate all of the physical frame caps */
@@ -183,9 +383,14 @@ static void *sel4platsupport_map_paddr_with_page_size(sel4platsupport_io_mapper_
                                             mapping->page_size_bits, cached);
     if (mapping->mapped_addr != NULL) {
         /* fill out and insert node */
-        mapping->returned_addr = mapping->mapped_addr + offset;
+        io_handle_t *handle = add_handle(io_mapper, mapping, mapping->mapped_addr + offset);
+        if (handle == NULL) {
+            vspace_unmap_pages(vspace, mapping->mapped_addr, mapping->num_pages, mapping->page_size_bits,
+                               VSPACE_PRESERVE);
+            goto error;
+        }
         insert_node(io_mapper, mapping);
-        return mapping->returned_addr;
+        return handle;
     }
 error:
     destroy_node(vka, mapping);
@@ -201,6 +406,25 @@ static void *sel4platsupport_map_paddr(void *cookie, uintptr_t paddr, size_t siz
     }
 
     sel4platsupport_io_mapper_cookie_t *io_mapper = (sel4platsupport_io_mapper_cookie_t *)cookie;
+
+    /* repeated requests go straight to the handle that served them before */
+    io_request_t *request = *find_request(io_mapper, paddr, size, cached);
+    if (request) {
+        io_handle_t *handle = add_handle(io_mapper, request->handle->mapping, request->handle->returned_addr);
+        return handle ? handle->returned_addr : NULL;
+    }
+
+    /* reuse an existing mapping if one already covers this region */
+    io_mapping_t *existing = find_covering_node(io_mapper, paddr, size, cached);
+    if (existing) {
+        io_handle_t *handle = add_handle(io_mapper, existing, existing->mapped_addr + (paddr - existing->paddr));
+        if (!handle) {
+            return NULL;
+        }
+        add_request(io_mapper, handle, paddr, size, cached);
+        return handle->returned_addr;
+    }
+
     int frame_size_index = 0;
     /* find the largest reasonable frame size */
     while (frame_size_index + 1 < SEL4_NUM_PAGE_SIZES) {
@@ -212,9 +436,11 @@ static void *sel4platsupport_map_paddr(void *cookie, uintptr_t paddr, size_t siz
 
     /* try mapping in this and all smaller frame sizes until something works */
     for (int i = frame_size_index; i >= 0; i--) {
-        void *result = sel4platsupport_map_paddr_with_page_size(io_mapper, paddr, size, sel4_page_sizes[i], cached);
-        if (result) {
-            return result;
+        io_handle_t *handle = sel4platsupport_map_paddr_with_page_size(io_mapper, paddr, size, sel4_page_sizes[i],
+                                                                       cached);
+        if (handle) {
+            add_request(io_mapper, handle, paddr, size, cached);
+            return handle->returned_addr;
         }
     }
 
@@ -233,13 +459,29 @@ static void sel4platsupport_unmap_vaddr(void *cookie, void *vaddr, UNUSED size_t
 
     vspace_t *vspace = io_mapper->vspace;
     vka_t *vka = io_mapper->vka;
-    io_mapping_t *mapping = find_node(io_mapper, vaddr);
+    io_handle_t **slot = find_handle(io_mapper, vaddr);
+    io_handle_t *handle = *slot;
 
-    if (!mapping) {
+    if (!handle) {
         ZF_LOGF("Tried to unmap vaddr %p, which was never mapped in", vaddr);
         return;
     }
 
+    io_mapping_t *mapping = handle->mapping;
+    handle->refcount--;
+    if (handle->refcount == 0) {
+        *slot = handle->hash_next;
+        io_mapper->num_handles--;
+        remove_requests(io_mapper, handle);
+        free(handle);
+    }
+
+    mapping->refcount--;
+    if (mapping->refcount > 0) {
+        /* still in use through another map call */
+        return;
+    }
+
     /* unmap the pages */
     vspace_unmap_pages(vspace, mapping->mapped_addr, mapping->num_pages, mapping->page_size_bits,
                        VSPACE_PRESERVE);
@@ -249,6 +491,13 @@ static void sel4platsupport_unmap_vaddr(void *cookie, void *vaddr, UNUSED size_t
     destroy_node(vka, mapping);
 }
 
+static void free_io_mapper_cookie(sel4platsupport_io_mapper_cookie_t *cookie)
+{
+    free(cookie->buckets);
+    free(cookie->request_buckets);
+    free(cookie);
+}
+
 int sel4platsupport_new_io_mapper(vspace_t *vspace, vka_t *vka, ps_io_mapper_t *io_mapper)
 {
     sel4platsupport_io_mapper_cookie_t *cookie = calloc(1, sizeof(sel4platsupport_io_mapper_cookie_t));
@@ -257,6 +506,16 @@ int sel4platsupport_new_io_mapper(vspace_t *vspace, vka_t *vka, ps_io_mapper_t *
         return -1;
     }
 
+    cookie->buckets = calloc(IO_MAPPER_INITIAL_BUCKETS, sizeof(io_handle_t *));
+    cookie->request_buckets = calloc(IO_MAPPER_INITIAL_BUCKETS, sizeof(io_request_t *));
+    if (!cookie->buckets || !cookie->request_buckets) {
+        ZF_LOGE("Failed to allocate mapping index");
+        free_io_mapper_cookie(cookie);
+        return -1;
+    }
+
+    cookie->num_buckets = IO_MAPPER_INITIAL_BUCKETS;
+    cookie->num_request_buckets = IO_MAPPER_INITIAL_BUCKETS;
     cookie->vspace = vspace;
     cookie->vka = vka;
     io_mapper->cookie = cookie;
@@ -341,7 +600,7 @@ int sel4platsupport_new_io_ops(vspace_t *vspace, vka_t *vka, simple_t *simple, p
 
     error = sel4platsupport_new_fdt_ops(&io_ops->io_fdt, simple, &io_ops->malloc_ops);
     if (error) {
-        free(io_ops->io_mapper.cookie);
+        free_io_mapper_cookie(io_ops->io_mapper.cookie);
         io_ops->io_mapper.cookie = NULL;
         return error;
     }
@@ -349,7 +608,7 @@ int sel4platsupport_new_io_ops(vspace_t *vspace, vka_t *vka, simple_t *simple, p
     error = sel4platsupport_new_irq_ops(&io_ops->irq_ops, vka, simple, DEFAULT_IRQ_INTERFACE_CONFIG,
                                         &io_ops->malloc_ops);
     if (error) {
-        free(io_ops->io_mapper.cookie);
+        free_io_mapper_cookie(io_ops->io_mapper.cookie);
         io_ops->io_mapper.cookie = NULL;
         ssize_t fdt_size = simple_get_extended_bootinfo_length(simple, SEL4_BOOTINFO_HEADER_FDT);
         if (fdt_size > 0) {
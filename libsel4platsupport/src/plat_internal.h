@@ -15,6 +15,8 @@ int
 __plat_serial_init(ps_io_ops_t* io_ops);
 void
 __plat_putchar(int c);
+size_t
+__plat_write(char *data, size_t count);
 int
 __plat_getchar(void);
 
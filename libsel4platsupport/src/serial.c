@@ -60,6 +60,28 @@ void __plat_putchar(int c)
     }
 }
 
+/* Pass a whole buffer to the console device in as few writes as it will
+ * accept, rather than one write per character */
+size_t __plat_write(char *data, size_t count)
+{
+    size_t sent = 0;
+    if (console) {
+        while (sent < count) {
+            ssize_t ret = ps_cdev_write(console, data + sent, count - sent, NULL, NULL);
+            if (ret <= 0) {
+                break;
+            }
+            sent += ret;
+        }
+        /* fall back to ps_cdev_putchar, as __plat_putchar uses, if the device
+         * stops making progress */
+        for (; sent < count; sent++) {
+            ps_cdev_putchar(console, data[sent]);
+        }
+    }
+    return count;
+}
+
 int __plat_getchar(void)
 {
     if (console) {
@@ -19,12 +19,107 @@
 #include <vspace/page.h>
 #include <vka/kobject_t.h>
 
+/* Lookup structures built once by simple_default_init_bootinfo, for the bootinfo it was
+ * last called with. Any other bootinfo is searched linearly. */
+static struct {
+    seL4_BootInfo *bi;
+    /* indices into the untyped list, sorted by paddr */
+    uint16_t untypeds[CONFIG_MAX_NUM_BOOTINFO_UNTYPED_CAPS];
+    size_t num_untypeds;
+    /* offset of the first extended bootinfo header of each type, -1 if there is none */
+    ssize_t extended_offsets[SEL4_BOOTINFO_HEADER_NUM];
+} bi_index;
+
+static void build_bi_index(seL4_BootInfo *bi)
+{
+    size_t num = MIN(bi->untyped.end - bi->untyped.start, CONFIG_MAX_NUM_BOOTINFO_UNTYPED_CAPS);
+
+    /* insertion sort, the untyped list is short and mostly sorted already */
+    for (size_t i = 0; i < num; i++) {
+        size_t j = i;
+        while (j > 0 && bi->untypedList[bi_index.untypeds[j - 1]].paddr > bi->untypedList[i].paddr) {
+            bi_index.untypeds[j] = bi_index.untypeds[j - 1];
+            j--;
+        }
+        bi_index.untypeds[j] = i;
+    }
+    bi_index.num_untypeds = num;
+
+    for (int type = 0; type < SEL4_BOOTINFO_HEADER_NUM; type++) {
+        bi_index.extended_offsets[type] = -1;
+    }
+    /* start of the extended bootinfo is defined to be 4K from the start of regular bootinfo */
+    uintptr_t base = (uintptr_t)bi + seL4_BootInfoFrameSize;
+    for (uintptr_t cur = base; cur < base + bi->extraLen;) {
+        seL4_BootInfoHeader *header = (seL4_BootInfoHeader *)cur;
+        if (header->len == 0) {
+            ZF_LOGE("Malformed extended bootinfo header");
+            break;
+        }
+        if (header->id < SEL4_BOOTINFO_HEADER_NUM && bi_index.extended_offsets[header->id] == -1) {
+            bi_index.extended_offsets[header->id] = cur - base;
+        }
+        cur += header->len;
+    }
+
+    bi_index.bi = bi;
+}
+
+/* find the untyped with the highest paddr not above paddr, returning its index in the untyped list */
+static int find_untyped(seL4_BootInfo *bi, seL4_Word paddr)
+{
+    size_t low = 0;
+    size_t high = bi_index.num_untypeds;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (bi->untypedList[bi_index.untypeds[mid]].paddr <= paddr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low == 0 ? -1 : bi_index.untypeds[low - 1];
+}
+
+/* find the extended bootinfo header of a type, or NULL if there is none */
+static seL4_BootInfoHeader *find_extended_bootinfo(seL4_BootInfo *bi, seL4_Word type)
+{
+    /* start of the extended bootinfo is defined to be 4K from the start of regular bootinfo */
+    uintptr_t cur = (uintptr_t)bi + seL4_BootInfoFrameSize;
+
+    if (bi == bi_index.bi && type < SEL4_BOOTINFO_HEADER_NUM) {
+        ssize_t offset = bi_index.extended_offsets[type];
+        return offset == -1 ? NULL : (seL4_BootInfoHeader *)(cur + offset);
+    }
+
+    uintptr_t end = cur + bi->extraLen;
+    while (cur < end) {
+        seL4_BootInfoHeader *header = (seL4_BootInfoHeader *)cur;
+        if (header->id == type) {
+            return header;
+        }
+        cur += header->len;
+    }
+    return NULL;
+}
+
 void *simple_default_get_frame_info(void *data, void *paddr, int size_bits, seL4_CPtr *frame_cap, seL4_Word *offset)
 {
     unsigned int i;
     seL4_BootInfo *bi = (seL4_BootInfo *) data;
     assert(bi && paddr && offset && frame_cap);
 
+    if (bi == bi_index.bi) {
+        /* untypeds don't overlap, so only the one below paddr can contain the frame */
+        int ut = find_untyped(bi, (seL4_Word)paddr);
+        if (ut != -1 &&
+            bi->untypedList[ut].paddr + BIT(bi->untypedList[ut].sizeBits) >= (seL4_Word)paddr + BIT(size_bits)) {
+            *frame_cap = bi->untyped.start + ut;
+            *offset = (seL4_Word)paddr - bi->untypedList[ut].paddr;
+        }
+        return NULL;
+    }
+
     for (i = 0; i < bi->untyped.end - bi->untyped.start; i++) {
         if (bi->untypedList[i].paddr <= (seL4_Word)paddr &&
             bi->untypedList[i].paddr + BIT(bi->untypedList[i].sizeBits) >= (seL4_Word)paddr + BIT(size_bits)) {
@@ -41,6 +136,16 @@ seL4_Error simple_default_get_frame_cap(void *data, void *paddr, int size_bits,
     seL4_BootInfo *bi = (seL4_BootInfo *) data;
     assert(bi && paddr);
 
+    if (bi == bi_index.bi) {
+        int ut = find_untyped(bi, (seL4_Word)paddr);
+        if (ut != -1 && bi->untypedList[ut].paddr == (seL4_Word)paddr &&
+            bi->untypedList[ut].sizeBits >= size_bits) {
+            return seL4_Untyped_Retype(bi->untyped.start + ut, kobject_get_type(KOBJECT_FRAME, size_bits),
+                                       size_bits, path->root, path->dest, path->destDepth, path->offset, 1);
+        }
+        return seL4_FailedLookup;
+    }
+
     for (i = 0; i < bi->untyped.end - bi->untyped.start; i++) {
         if (bi->untypedList[i].paddr == (seL4_Word)paddr &&
             bi->untypedList[i].sizeBits >= size_bits) {
@@ -229,17 +334,11 @@ ssize_t simple_default_get_extended_bootinfo_size(void *data, seL4_Word type)
     }
     seL4_BootInfo *bi = data;
 
-    /* start of the extended bootinfo is defined to be 4K from the start of regular bootinfo */
-    uintptr_t cur = (uintptr_t)bi + seL4_BootInfoFrameSize;
-    uintptr_t end = cur + bi->extraLen;
-    while (cur < end) {
-        seL4_BootInfoHeader *header = (seL4_BootInfoHeader *)cur;
-        if (header->id == type) {
-            return header->len;
-        }
-        cur += header->len;
+    seL4_BootInfoHeader *header = find_extended_bootinfo(bi, type);
+    if (header == NULL) {
+        return -1;
     }
-    return -1;
+    return header->len;
 }
 
 ssize_t simple_default_get_extended_bootinfo(void *data, seL4_Word type, void *dest, ssize_t max_len)
@@ -251,19 +350,13 @@ ssize_t simple_default_get_extended_bootinfo(void *data, seL4_Word type, void *d
         ZF_LOGE("Unexpected negative size");
         return -1;
     }
-    /* start of the extended bootinfo is defined to be 4K from the start of regular bootinfo */
-    uintptr_t cur = (uintptr_t)bi + seL4_BootInfoFrameSize;
-    uintptr_t end = cur + bi->extraLen;
-    while (cur < end) {
-        seL4_BootInfoHeader *header = (seL4_BootInfoHeader *)cur;
-        if (header->id == type) {
-            ssize_t copy_len = MIN(header->len, max_len);
-            memcpy(dest, (void *)cur, copy_len);
-            return copy_len;
-        }
-        cur += header->len;
+    seL4_BootInfoHeader *header = find_extended_bootinfo(bi, type);
+    if (header == NULL) {
+        return -1;
     }
-    return -1;
+    ssize_t copy_len = MIN(header->len, max_len);
+    memcpy(dest, (void *)header, copy_len);
+    return copy_len;
 }
 
 void simple_default_init_bootinfo(simple_t *simple, seL4_BootInfo *bi)
@@ -271,6 +364,8 @@ void simple_default_init_bootinfo(simple_t *simple, seL4_BootInfo *bi)
     assert(simple);
     assert(bi);
 
+    build_bi_index(bi);
+
     simple->data = bi;
     simple->frame_info = &simple_default_get_frame_info;
     simple->frame_cap = &simple_default_get_frame_cap;
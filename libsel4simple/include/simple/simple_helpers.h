@@ -11,6 +11,29 @@
 #include <simple/simple.h>
 #include <vka/vka.h>
 
+#define SIMPLE_CAP_TABLE_MAX_RANGES 32
+
+/* Slots [start, end) */
+typedef struct simple_cap_range {
+    seL4_CPtr start;
+    seL4_CPtr end;
+} simple_cap_range_t;
+
+/* Table of the caps of a simple, built once so that classifying a cap doesn't need to
+ * enumerate every cap through the simple interface */
+typedef struct simple_cap_table {
+    simple_t *simple;
+    /* sorted, disjoint ranges of slots that hold caps */
+    simple_cap_range_t used[SIMPLE_CAP_TABLE_MAX_RANGES];
+    size_t num_used;
+    /* sorted, disjoint ranges of slots that hold untyped caps */
+    simple_cap_range_t untypeds[SIMPLE_CAP_TABLE_MAX_RANGES];
+    size_t num_untypeds;
+    /* the caps didn't fit in the ranges above, queries fall back to the simple interface */
+    bool overflow;
+    seL4_CPtr last_valid;
+} simple_cap_table_t;
+
 bool simple_is_untyped_cap(simple_t *simple, seL4_CPtr pos);
 
 /* Returns the capability with the largest CPtr. This allows for any potential free slots
@@ -18,3 +41,20 @@ bool simple_is_untyped_cap(simple_t *simple, seL4_CPtr pos);
 seL4_CPtr simple_last_valid_cap(simple_t *simple);
 
 void simple_make_vka(simple_t *simple, vka_t *vka);
+
+/**
+ * Build a table of the caps of a simple.
+ *
+ * @param simple simple to build the table of, must outlive the table
+ * @param table  table to initialise
+ */
+void simple_cap_table_init(simple_t *simple, simple_cap_table_t *table);
+
+/* As simple_is_untyped_cap, using a table built by simple_cap_table_init */
+bool simple_cap_table_is_untyped(simple_cap_table_t *table, seL4_CPtr pos);
+
+/* @return true if the slot holds one of the caps of the simple */
+bool simple_cap_table_is_used(simple_cap_table_t *table, seL4_CPtr pos);
+
+/* As simple_last_valid_cap, using a table built by simple_cap_table_init */
+seL4_CPtr simple_cap_table_last_valid_cap(simple_cap_table_t *table);
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <string.h>
 #include <simple/simple_helpers.h>
 
 bool simple_is_untyped_cap(simple_t *simple, seL4_CPtr pos)
@@ -86,3 +87,113 @@ seL4_CPtr simple_last_valid_cap(simple_t *simple)
     }
     return largest;
 }
+
+/* binary search for the range containing pos, or the index it would be inserted at */
+static size_t range_find(simple_cap_range_t *ranges, size_t num, seL4_CPtr pos)
+{
+    size_t low = 0;
+    size_t high = num;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ranges[mid].end <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static bool range_contains(simple_cap_range_t *ranges, size_t num, seL4_CPtr pos)
+{
+    size_t i = range_find(ranges, num, pos);
+    return i < num && ranges[i].start <= pos;
+}
+
+/* add a slot to a set of sorted ranges, merging it with its neighbours */
+static int range_insert(simple_cap_range_t *ranges, size_t *num, seL4_CPtr pos)
+{
+    size_t i = range_find(ranges, *num, pos);
+    if (i < *num && ranges[i].start <= pos) {
+        return 0;
+    }
+    bool merge_prev = i > 0 && ranges[i - 1].end == pos;
+    bool merge_next = i < *num && ranges[i].start == pos + 1;
+
+    if (merge_prev && merge_next) {
+        ranges[i - 1].end = ranges[i].end;
+        memmove(&ranges[i], &ranges[i + 1], (*num - i - 1) * sizeof(*ranges));
+        (*num)--;
+    } else if (merge_prev) {
+        ranges[i - 1].end = pos + 1;
+    } else if (merge_next) {
+        ranges[i].start = pos;
+    } else {
+        if (*num == SIMPLE_CAP_TABLE_MAX_RANGES) {
+            return -1;
+        }
+        memmove(&ranges[i + 1], &ranges[i], (*num - i) * sizeof(*ranges));
+        ranges[i] = (simple_cap_range_t) {
+            .start = pos, .end = pos + 1
+        };
+        (*num)++;
+    }
+    return 0;
+}
+
+void simple_cap_table_init(simple_t *simple, simple_cap_table_t *table)
+{
+    assert(simple && table);
+
+    *table = (simple_cap_table_t) {
+        .simple = simple
+    };
+
+    int cap_count = simple_get_cap_count(simple);
+    for (int i = 0; i < cap_count; i++) {
+        seL4_CPtr cap = simple_get_nth_cap(simple, i);
+        table->last_valid = MAX(table->last_valid, cap);
+        if (!table->overflow && range_insert(table->used, &table->num_used, cap) != 0) {
+            table->overflow = true;
+        }
+    }
+
+    int untyped_count = simple_get_untyped_count(simple);
+    for (int i = 0; i < untyped_count && !table->overflow; i++) {
+        seL4_CPtr cap = simple_get_nth_untyped(simple, i, NULL, NULL, NULL);
+        if (range_insert(table->untypeds, &table->num_untypeds, cap) != 0) {
+            table->overflow = true;
+        }
+    }
+
+    if (table->overflow) {
+        ZF_LOGW("Too many cap ranges for the table, falling back to scanning");
+    }
+}
+
+bool simple_cap_table_is_untyped(simple_cap_table_t *table, seL4_CPtr pos)
+{
+    if (table->overflow) {
+        return simple_is_untyped_cap(table->simple, pos);
+    }
+    return range_contains(table->untypeds, table->num_untypeds, pos);
+}
+
+bool simple_cap_table_is_used(simple_cap_table_t *table, seL4_CPtr pos)
+{
+    if (table->overflow) {
+        int cap_count = simple_get_cap_count(table->simple);
+        for (int i = 0; i < cap_count; i++) {
+            if (simple_get_nth_cap(table->simple, i) == pos) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return range_contains(table->used, table->num_used, pos);
+}
+
+seL4_CPtr simple_cap_table_last_valid_cap(simple_cap_table_t *table)
+{
+    return table->last_valid;
+}
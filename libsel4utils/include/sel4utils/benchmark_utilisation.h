@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+#ifdef CONFIG_BENCHMARK_TRACK_UTILISATION
+
+#include <inttypes.h>
+#include <sel4/sel4.h>
+#include <sel4/benchmark_utilisation_types.h>
+#include <sel4utils/thread.h>
+
+/* Per-thread cycle accounting using the kernel's utilisation tracking.
+ *
+ * The kernel accumulates the cycles each TCB has spent running between
+ * seL4_BenchmarkResetLog and seL4_BenchmarkFinalizeLog. Threads are registered
+ * in a table, which is then sampled periodically (e.g. from a timer or a
+ * monitor thread) to attribute cycles to each thread. The kernel does not
+ * snapshot performance counters on context switch, so only cycles can be
+ * attributed to threads this way. */
+
+typedef struct sel4utils_thread_utilisation {
+    sel4utils_thread_t *thread;
+    const char *name;
+    /* cycles the thread has run for since the table was reset */
+    uint64_t cycles;
+    /* cycles the thread ran for between the two most recent samples */
+    uint64_t delta;
+} sel4utils_thread_utilisation_t;
+
+typedef struct sel4utils_utilisation_table {
+    sel4utils_thread_utilisation_t *entries;
+    size_t num_entries;
+    size_t capacity;
+    /* total cycles on this core since the table was reset, and between
+     * the two most recent samples */
+    uint64_t total;
+    uint64_t total_delta;
+} sel4utils_utilisation_table_t;
+
+/* Initialise a table using caller provided storage for capacity threads */
+void sel4utils_utilisation_table_init(sel4utils_utilisation_table_t *table,
+                                      sel4utils_thread_utilisation_t *entries, size_t capacity);
+
+/* Add a thread to a table. Returns -1 if the table is full. */
+int sel4utils_utilisation_table_add(sel4utils_utilisation_table_t *table, sel4utils_thread_t *thread,
+                                    const char *name);
+
+/* Reset the kernel's utilisation counters for every thread in the table and start tracking */
+void sel4utils_utilisation_table_reset(sel4utils_utilisation_table_t *table);
+
+/* Read the cycles attributed to each thread in the table so far. Must be called on
+ * the core the threads are running on, as totals are tracked per core.
+ *
+ * The kernel only computes the total once the log is finalised, which also stops
+ * tracking, so each sample finalises the log, reads the counters and resets the log
+ * again. The cycles spent between the finalise and the reset are not attributed to
+ * any thread, and the reset also clears the kernel's trace log. */
+void sel4utils_utilisation_table_sample(sel4utils_utilisation_table_t *table);
+
+/* Print a table of cycles attributed to each thread, along with its share
+ * of the total over the whole run and over the last sample interval. */
+void sel4utils_utilisation_table_dump(sel4utils_utilisation_table_t *table);
+
+#endif /* CONFIG_BENCHMARK_TRACK_UTILISATION */
@@ -21,8 +21,9 @@
  * Due to its reliance on malloc for actually allocating memory blocks, and because malloc'ed memory is
  * assumed to be cached, it only supports cached allocations. The basic operation of this allocator is to
  * malloc block of memory, find the frame capabilities, duplicate and map these into the appropriate
- * iospaces. It is the responsibility of the user to ensure that whatever frames are used in mapping
- * the malloc region are of a size that the hardware will accept being mapped into the IOMMU
+ * iospaces such that the iovaddr of each frame corresponds to its vaddr. It is the responsibility of the
+ * user to ensure that whatever frames are used in mapping the malloc region are of a size that the
+ * hardware will accept being mapped into the IOMMU
  * @param vka Allocation interface used for allocated cslots and any required paging structures for the iospace.
  *            This interface will be copied
  * @param vspace Virtual memory manager that needs to contain any mappings used to back malloc.
@@ -35,21 +36,39 @@
 int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man, unsigned int num_iospaces,
                                    seL4_CPtr *iospaces);
 
+/**
+ * As sel4utils_make_iommu_dma_alloc, except that IO virtual addresses are not tied to vaddrs.
+ * Each block is given an IO virtual address below 4GiB, so that devices limited to 32-bit DMA
+ * work on any platform. The frames are duplicated and mapped into an iospace, in a single batch,
+ * the first time the block is pinned, and are unmapped again once the last pin is released. The
+ * IO virtual address is the same in every iospace and must be obtained from ps_dma_pin; it is
+ * not the vaddr of the block.
+ *
+ * Parameters and return value are as for sel4utils_make_iommu_dma_alloc.
+ */
+int sel4utils_make_iommu_dma_alloc_iova(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man,
+                                        unsigned int num_iospaces, seL4_CPtr *iospaces);
+
 /**
  * Variant of ps_dma_alloc that allows the caller to allocate memory in their address space for use
  * as the dma buffer. This function takes a description of a region of (virtual) memory, and maps
- * the frames that back the region into the dma manager's iospace such that the iovaddr of each frame
- * corresponds to its vaddr.
+ * the frames that back the region into all of the dma manager's iospaces. The mappings are held until
+ * the region is passed to ps_dma_free. For a dma manager created with sel4utils_make_iommu_dma_alloc
+ * the iovaddr of each frame corresponds to its vaddr. For one created with
+ * sel4utils_make_iommu_dma_alloc_iova the region is given its own IO virtual address, which must be
+ * retrieved with ps_dma_pin.
  *
  * The intended use case for this function is in environments without a dynamic heap (that is, where
  * malloc is not backed by a vspace). The dma_man argument must be a pointer to a dma manager that
- * was created using sel4utils_make_iommu_dma_alloc. The vspace argument to sel4utils_make_iommu_dma_alloc
- * must be able to resolve vaddrs within the specified buffer to frame caps with its get_cap function.
+ * was created using sel4utils_make_iommu_dma_alloc or sel4utils_make_iommu_dma_alloc_iova. The vspace
+ * argument it was created with must be able to resolve vaddrs within the specified buffer to frame caps
+ * with its get_cap function.
  *
  * This function takes a cookie rather than a dma manager to allow it to be used in the implementation
  * of a ps_dma_alloc_fn_t.
  *
- * @param dma_cookie The cookie of a dma manager initialised with sel4utils_make_iommu_dma_alloc.
+ * @param dma_cookie The cookie of a dma manager initialised with sel4utils_make_iommu_dma_alloc or
+ *                   sel4utils_make_iommu_dma_alloc_iova.
  * @param vaddr A pointer to a region of memory to use as the dma buffer. The vspace given to
  *              sel4utils_make_iommu_dma_alloc to initialise dma_man must be able to resolve
  *              addresses in this buffer to frame caps with its get_cap function.
@@ -57,4 +76,30 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
  * @return 0 on success
  */
 int sel4utils_iommu_dma_alloc_iospace(void *dma_cookie, void *vaddr, size_t size);
+
+/**
+ * Pins a buffer for use by the device behind a single iospace, mapping it into that iospace if it
+ * is not already. Buffers that are pinned by several devices share a single IO virtual address.
+ * Buffers of a dma manager created with sel4utils_make_iommu_dma_alloc are always mapped into every
+ * iospace, so this only returns their IO virtual address, which is their vaddr.
+ *
+ * @param dma_cookie The cookie of a dma manager initialised with sel4utils_make_iommu_dma_alloc or
+ *                   sel4utils_make_iommu_dma_alloc_iova.
+ * @param iospace Index into the list of iospaces the dma manager was created with.
+ * @param vaddr Address within a buffer allocated from the dma manager.
+ * @return IO virtual address of vaddr, or 0 on failure
+ */
+uintptr_t sel4utils_iommu_dma_pin_iospace(void *dma_cookie, int iospace, void *vaddr);
+
+/**
+ * Releases a pin taken with sel4utils_iommu_dma_pin_iospace. The buffer is unmapped from the
+ * iospace once nothing holds a pin for it. Does nothing for a dma manager created with
+ * sel4utils_make_iommu_dma_alloc.
+ *
+ * @param dma_cookie The cookie of a dma manager initialised with sel4utils_make_iommu_dma_alloc or
+ *                   sel4utils_make_iommu_dma_alloc_iova.
+ * @param iospace Index into the list of iospaces the dma manager was created with.
+ * @param vaddr Address within a buffer allocated from the dma manager.
+ */
+void sel4utils_iommu_dma_unpin_iospace(void *dma_cookie, int iospace, void *vaddr);
 #endif /* CONFIG_IOMMU */
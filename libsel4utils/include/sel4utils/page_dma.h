@@ -9,6 +9,7 @@
 #include <autoconf.h>
 #include <sel4utils/gen_config.h>
 
+#include <stdbool.h>
 #include <sel4/sel4.h>
 #include <vka/vka.h>
 #include <vspace/vspace.h>
@@ -17,8 +18,9 @@
 /**
  * Creates an implementation of a dma manager that is designed to allocate at page granularity. Due
  * to implementation details it will round up all allocations to the next power of 2, or 4k (whichever
- * is larger). This allocator will put mappings into the vspace with custom cookie values and you
- * must free all dma allocations before tearing down the vspace
+ * is larger). Each allocation is backed by a single untyped and is mapped with large pages once it is
+ * big enough. Alignments beyond 4k are supported, in which case the allocation is also rounded up to
+ * the alignment. You must free all dma allocations before tearing down the vspace
  * @param vka Allocation interface for allocating untypeds (for frames) and slots
  * @param vspace Virtual memory manager used for mapping frames
  * @param dma_man Pointer to dma manager struct that will be filled out
@@ -26,3 +28,63 @@
  */
 int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man);
 
+/**
+ * Creates a page dma manager, as above, that additionally serves allocations smaller than a page
+ * from pools. Each pool carves physically contiguous chunks of BIT(chunk_size_bits) bytes into
+ * buffers of a single power of 2 size class, from 64 bytes up to half a page, and allocating or
+ * freeing a buffer is a free list operation. Chunks are never returned to the vka. Passing
+ * seL4_LargePageBits backs the pools with large pages.
+ * @param vka Allocation interface for allocating untypeds (for frames) and slots
+ * @param vspace Virtual memory manager used for mapping frames
+ * @param chunk_size_bits Size of the chunks used to grow a pool, must be at least a page
+ * @param dma_man Pointer to dma manager struct that will be filled out
+ * @return 0 on success
+ */
+int sel4utils_new_page_dma_pool_alloc(vka_t *vka, vspace_t *vspace, size_t chunk_size_bits, ps_dma_man_t *dma_man);
+
+/**
+ * Grows the pool that serves allocations of the given size until it holds at least count free
+ * buffers, so that a driver can take the cost of allocating chunks up front.
+ * @param dma_man Dma manager created by sel4utils_new_page_dma_pool_alloc
+ * @param size Size of the buffers that will be allocated
+ * @param cached Whether the buffers will be allocated as cached
+ * @param count Number of free buffers the pool should hold
+ * @return 0 on success
+ */
+int sel4utils_page_dma_pool_prefill(ps_dma_man_t *dma_man, size_t size, int cached, size_t count);
+
+/* A single contiguous range of a scatter/gather list */
+typedef struct sel4utils_dma_sg {
+    void *addr;
+    size_t len;
+} sel4utils_dma_sg_t;
+
+/**
+ * Performs a cache operation over every range of a scatter/gather list. Ranges that are virtually
+ * adjacent are merged, and each range is maintained with as few kernel invocations as the frames
+ * backing it allow.
+ * @param dma_man Dma manager created by one of the page dma constructors
+ * @param sg List of ranges
+ * @param num_sg Number of entries in sg
+ * @param op Cache operation to perform
+ */
+void sel4utils_page_dma_cache_op_sg(ps_dma_man_t *dma_man, const sel4utils_dma_sg_t *sg, size_t num_sg,
+                                    dma_cache_op_t op);
+
+/**
+ * Declares whether all device accesses through this dma manager are cache coherent. When they
+ * are, cache operations return without touching the cache.
+ * @param dma_man Dma manager created by one of the page dma constructors
+ * @param coherent True if the platform is coherent with respect to DMA
+ */
+void sel4utils_page_dma_set_coherent(ps_dma_man_t *dma_man, bool coherent);
+
+/**
+ * Declares whether a single allocation is used by a coherent device, so cache operations on it
+ * can be skipped. Only allocations that do not come from a pool can be marked.
+ * @param dma_man Dma manager created by one of the page dma constructors
+ * @param addr Address returned by the allocation
+ * @param coherent True if device accesses to the allocation are coherent
+ * @return 0 on success
+ */
+int sel4utils_page_dma_set_buffer_coherent(ps_dma_man_t *dma_man, void *addr, bool coherent);
@@ -19,12 +19,7 @@
 
 #define WORD_STRING_SIZE ((CONFIG_WORD_SIZE / 3) + 1)
 
-typedef struct object_node object_node_t;
-
-struct object_node {
-    vka_object_t object;
-    object_node_t *next;
-};
+typedef struct sel4utils_object_chunk sel4utils_object_chunk_t;
 
 typedef struct {
     vka_object_t pd;
@@ -40,7 +35,12 @@ typedef struct {
     /* cptr (with respect to the process cnode) of the tcb of the first thread (0 means not supplied) */
     seL4_CPtr dest_tcb_cptr;
     seL4_Word pagesz;
-    object_node_t *allocated_object_list_head;
+    /* objects allocated by the vspace, grouped by object type, freed on destroy */
+    sel4utils_object_chunk_t *allocated_objects[seL4_ObjectTypeCount];
+    /* empty chunk kept ready so that tracking an object never has to wait on malloc.
+     * The above are updated without locks, as a process may be shared by several
+     * spawner threads. */
+    sel4utils_object_chunk_t *spare_object_chunk;
     /* ELF headers that describe the sections of the loaded image (at least as they
      * existed at load time). Is different to the elf_regions, which have reservations,
      * these are the original headers from the elf and include nonloaded information regions */
@@ -243,6 +243,56 @@ seL4_CPtr sel4utils_move_cap_to_process(sel4utils_process_t *process, cspacepath
 seL4_CPtr sel4utils_mint_cap_to_process(sel4utils_process_t *process, cspacepath_t src, seL4_CapRights_t rights,
                                         seL4_Word data);
 
+/**
+ * Copy many caps into a process' cspace.
+ *
+ * The caps are copied into contiguous slots, which are reserved up front so each cap costs
+ * a single CNode invocation. If any copy fails the caps already copied are deleted again.
+ *
+ * @param process process to copy the caps to
+ * @param srcs    paths in the current cspace to copy the caps from
+ * @param num     number of caps to copy
+ *
+ * @return 0 on failure, otherwise the slot of the first cap, the others follow it in order.
+ */
+seL4_CPtr sel4utils_copy_paths_to_process(sel4utils_process_t *process, const cspacepath_t *srcs, size_t num);
+
+/**
+ * Copy a contiguous range of caps into a process' cspace.
+ *
+ * As sel4utils_copy_paths_to_process, except that the caps are in the num slots from first_cap
+ * on, so only first_cap is translated into a path.
+ *
+ * @param process   process to copy the caps to
+ * @param vka       vka that can translate the caps into cspacepath_t's
+ * @param first_cap first cap of the range in your own cspace
+ * @param num       number of caps to copy
+ *
+ * @return 0 on failure, otherwise the slot of the first cap, the others follow it in order.
+ */
+seL4_CPtr sel4utils_copy_cap_range_to_process(sel4utils_process_t *process, vka_t *vka, seL4_CPtr first_cap,
+                                              size_t num);
+
+/**
+ * Move a populated CNode into a process' cspace.
+ *
+ * This hands over all caps in the CNode with a single invocation, however large it is. The
+ * process cspace configured by the functions above is single level, so the child can't invoke
+ * the caps in the CNode directly. Instead it uses the returned slot as the root of CNode
+ * invocations, with the index of a cap in the CNode and the CNode's size bits as depth, e.g.
+ * to move caps out into its own cspace as it needs them or to pass the whole CNode on. Processes
+ * that need to invoke the caps directly should use the CNode as their root cspace instead,
+ * see process_config_cnode.
+ *
+ * @param process  process to move the CNode to
+ * @param cnode    path in the current cspace to move the CNode cap from
+ * @param from_vka the allocator that owns the cslot the CNode is currently in, so it may be freed
+ *                 after the move. If NULL, then the original slot will not be freed.
+ *
+ * @return 0 on failure, otherwise the slot of the CNode in the processes cspace.
+ */
+seL4_CPtr sel4utils_move_cnode_to_process(sel4utils_process_t *process, cspacepath_t cnode, vka_t *from_vka);
+
 /**
  * Destroy a process.
  *
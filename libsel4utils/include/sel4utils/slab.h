@@ -5,6 +5,9 @@
  */
 #pragma once
 
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
 #include <vka/vka.h>
 #include <sel4/sel4.h>
 
@@ -19,12 +22,40 @@
  * Initialise with another allocator to perform cspace allocation,
  * untyped allocation.
  *
- * When the slab allocator runs out, it will delegate any
- * further allocations.
+ * When the slab for a type runs out, it grows by
+ * CONFIG_SEL4UTILS_SLAB_GROW_BATCH objects, retyped from a new
+ * untyped allocated from the delegate. If the slab cannot grow, or
+ * growth is disabled by setting the batch to 0, the object is allocated
+ * from the delegate instead. Types that were not given a frequency, or
+ * allocations of a different size, are always delegated.
+ *
+ * Endpoints and notifications are handed out as copies of a cap the
+ * slab keeps, and go back onto the slab when they are freed. Any caps
+ * still derived from them are revoked and a notification's pending
+ * signal is cleared, but no thread may be blocked on an object when it
+ * is freed. Other objects are moved out of the slab and their memory is
+ * not reused once they are freed.
  *
- * This allocator does not implement free, alloc_at, paddr or device related functions.
+ * This allocator does not implement alloc_at, paddr or device related functions.
  */
 
+typedef struct slab_stats {
+    /* allocations served from objects already in the slab */
+    size_t hits;
+    /* allocations that found the slab empty */
+    size_t misses;
+    /* objects returned to the slab */
+    size_t frees;
+    /* frees that made the object available again */
+    size_t recycled;
+    /* number of times the slab grew */
+    size_t grown;
+    /* allocations passed to the delegate because the slab could not grow */
+    size_t delegated;
+    /* objects currently available, only filled in by slab_get_stats */
+    size_t available;
+} slab_stats_t;
+
 /**
  * Initialise slab_vka
  *
@@ -34,3 +65,21 @@
  * @return 0 on success
  */
 int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount]);
+
+/**
+ * Get the allocation statistics of one object type, to check whether the
+ * object_freq given to slab_init matches the actual usage.
+ *
+ * @param slab_vka allocator initialised with slab_init
+ * @param type object type to get the statistics of
+ * @param stats filled out with the statistics
+ * @return 0 on success
+ */
+int slab_get_stats(vka_t *slab_vka, seL4_Word type, slab_stats_t *stats);
+
+/**
+ * Print the allocation statistics of every object type the slab serves.
+ *
+ * @param slab_vka allocator initialised with slab_init
+ */
+void slab_print_stats(vka_t *slab_vka);
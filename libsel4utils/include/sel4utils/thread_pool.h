@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ *
+ * A pool of fully configured threads (TCB, stack, IPC buffer, reply and scheduling context)
+ * that can be handed out and returned without allocating or freeing any kernel objects.
+ *
+ * Threads taken from the pool are suspended and configured exactly as
+ * sel4utils_configure_thread_config would leave them, so they are started with
+ * sel4utils_start_thread. Returning a thread suspends it and clears its registers; any other
+ * state the user changed, such as its priority or fault endpoint, is not reset.
+ *
+ */
+#pragma once
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <stdbool.h>
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+#include <simple/simple.h>
+#include <sel4utils/thread.h>
+
+typedef struct sel4utils_pool_thread sel4utils_pool_thread_t;
+
+typedef struct sel4utils_thread_pool {
+    vka_t *vka;
+    vspace_t *parent;
+    vspace_t *alloc;
+    /* configuration every thread in the pool is created with */
+    sel4utils_thread_config_t config;
+    /* number of cores threads are spread over */
+    int num_cores;
+    /* scheduling parameters for threads on each core */
+    sched_params_t core_params[CONFIG_MAX_NUM_NODES];
+    /* idle threads of each core */
+    sel4utils_pool_thread_t *idle[CONFIG_MAX_NUM_NODES];
+    size_t num_idle[CONFIG_MAX_NUM_NODES];
+    /* maximum number of idle threads kept per core, any more are destroyed when returned */
+    size_t max_idle;
+} sel4utils_thread_pool_t;
+
+/**
+ * Initialise a thread pool and create its warm threads.
+ *
+ * If simple is given, threads are spread over all of its cores and, on the MCS kernel, the
+ * scheduling context of each thread is created with the sched control of its core. Otherwise
+ * all threads use the scheduling parameters in config.
+ *
+ * @param pool uninitialised pool
+ * @param vka allocator for the objects of each thread, must outlive the pool
+ * @param parent vspace structure of the thread calling this function, used for temporary mappings
+ * @param alloc vspace to allocate stacks and IPC buffers in, must outlive the pool
+ * @param simple used to find the cores and their sched controls. Can be NULL.
+ * @param config configuration of every thread in the pool
+ * @param num_warm number of threads to create up front on each core
+ * @param max_idle maximum number of idle threads to keep on each core
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int sel4utils_thread_pool_init(sel4utils_thread_pool_t *pool, vka_t *vka, vspace_t *parent, vspace_t *alloc,
+                               simple_t *simple, sel4utils_thread_config_t config, size_t num_warm, size_t max_idle);
+
+/**
+ * Take a thread from the pool, creating one if the core has no idle threads.
+ *
+ * @param pool initialised pool
+ * @param core core the thread should run on
+ *
+ * @return a configured, suspended thread, or NULL on failure.
+ */
+sel4utils_thread_t *sel4utils_thread_pool_get(sel4utils_thread_pool_t *pool, int core);
+
+/**
+ * Suspend a thread taken from the pool, reset its registers and make it available again.
+ *
+ * @param pool pool the thread was taken from
+ * @param thread thread returned by sel4utils_thread_pool_get
+ */
+void sel4utils_thread_pool_put(sel4utils_thread_pool_t *pool, sel4utils_thread_t *thread);
+
+/**
+ * Move a thread taken from the pool to another core with sel4utils_set_sched_affinity, so
+ * that it is returned to the idle threads of that core.
+ *
+ * @param pool pool the thread was taken from
+ * @param thread thread returned by sel4utils_thread_pool_get
+ * @param core core to move the thread to
+ *
+ * @return 0 on success.
+ */
+int sel4utils_thread_pool_set_affinity(sel4utils_thread_pool_t *pool, sel4utils_thread_t *thread, int core);
+
+/**
+ * Destroy all idle threads of the pool. Threads that have not been returned must be
+ * returned first or they are leaked.
+ *
+ * @param pool pool to destroy
+ */
+void sel4utils_thread_pool_destroy(sel4utils_thread_pool_t *pool);
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ *
+ * A work stealing task scheduler. One worker thread is created per core, each with its own
+ * Chase-Lev deque of tasks. Workers take tasks from the bottom of their own deque and steal from
+ * the top of others when theirs is empty; workers that find no work park on a notification until
+ * new tasks are spawned.
+ *
+ * Parallelism is strict fork-join: tasks are spawned into a group and every task that spawns must
+ * sync its groups before it returns. sel4utils_ws_spawn and sel4utils_ws_sync can only be used
+ * from within a task; other threads enter the scheduler with sel4utils_ws_run or
+ * sel4utils_ws_parallel_for.
+ *
+ */
+#pragma once
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <stddef.h>
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+#include <simple/simple.h>
+#include <sel4utils/thread_config.h>
+
+typedef struct sel4utils_ws sel4utils_ws_t;
+
+typedef void (*sel4utils_ws_fn_t)(void *arg);
+typedef void (*sel4utils_ws_range_fn_t)(void *arg, size_t begin, size_t end);
+
+/* Set of spawned tasks that are waited for together */
+typedef struct sel4utils_ws_group {
+    long pending;
+} sel4utils_ws_group_t;
+
+#define SEL4UTILS_WS_GROUP_INIT { .pending = 0 }
+
+/**
+ * Create a scheduler and start its workers.
+ *
+ * If simple is given, workers are spread over its cores and, on the MCS kernel, each worker's
+ * scheduling context is created with the sched control of its core. Otherwise all workers use
+ * the scheduling parameters in config. Workers are pinned to their core with
+ * sel4utils_set_sched_affinity.
+ *
+ * @param vka allocator for the workers' objects, must outlive the scheduler
+ * @param vspace vspace of the caller, in which the workers run
+ * @param simple used to find the cores and their sched controls. Can be NULL.
+ * @param config configuration of every worker thread
+ * @param num_workers number of workers, 0 for one per core
+ *
+ * @return the scheduler, or NULL on failure.
+ */
+sel4utils_ws_t *sel4utils_ws_new(vka_t *vka, vspace_t *vspace, simple_t *simple, sel4utils_thread_config_t config,
+                                 int num_workers);
+
+/**
+ * Stop all workers and release the scheduler. No task may be running.
+ */
+void sel4utils_ws_destroy(sel4utils_ws_t *ws);
+
+/**
+ * Run a task on the scheduler and wait for it to complete. Only one thread outside the
+ * scheduler may be in sel4utils_ws_run at a time. When called from within a task, fn is
+ * simply called.
+ *
+ * @return 0 on success, -1 if another thread outside the scheduler is in sel4utils_ws_run.
+ */
+int sel4utils_ws_run(sel4utils_ws_t *ws, sel4utils_ws_fn_t fn, void *arg);
+
+/**
+ * Spawn a task into a group. Must be called from within a task. arg must remain valid until the
+ * group has been synced.
+ */
+void sel4utils_ws_spawn(sel4utils_ws_group_t *group, sel4utils_ws_fn_t fn, void *arg);
+
+/**
+ * Wait for all tasks of a group to complete, executing other tasks in the meantime. Must be
+ * called from within a task.
+ */
+void sel4utils_ws_sync(sel4utils_ws_group_t *group);
+
+/**
+ * Call fn over [begin, end), split recursively into ranges of at most grain elements that
+ * run in parallel. Can be called from within a task or from outside the scheduler.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_ws_parallel_for(sel4utils_ws_t *ws, size_t begin, size_t end, size_t grain,
+                              sel4utils_ws_range_fn_t fn, void *arg);
+
+/**
+ * @return the index of the worker executing the caller, or -1 outside the scheduler.
+ */
+int sel4utils_ws_worker_id(void);
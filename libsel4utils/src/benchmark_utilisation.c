@@ -0,0 +1,93 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#ifdef CONFIG_BENCHMARK_TRACK_UTILISATION
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <sel4/sel4.h>
+#include <sel4/benchmark_utilisation_types.h>
+#include <sel4utils/benchmark_utilisation.h>
+#include <utils/zf_log.h>
+
+void sel4utils_utilisation_table_init(sel4utils_utilisation_table_t *table,
+                                      sel4utils_thread_utilisation_t *entries, size_t capacity)
+{
+    table->entries = entries;
+    table->num_entries = 0;
+    table->capacity = capacity;
+    table->total = 0;
+    table->total_delta = 0;
+}
+
+int sel4utils_utilisation_table_add(sel4utils_utilisation_table_t *table, sel4utils_thread_t *thread,
+                                    const char *name)
+{
+    if (table->num_entries == table->capacity) {
+        ZF_LOGE("Utilisation table full");
+        return -1;
+    }
+    table->entries[table->num_entries] = (sel4utils_thread_utilisation_t) {
+        .thread = thread,
+        .name = name,
+    };
+    table->num_entries++;
+    return 0;
+}
+
+void sel4utils_utilisation_table_reset(sel4utils_utilisation_table_t *table)
+{
+    for (size_t i = 0; i < table->num_entries; i++) {
+        seL4_BenchmarkResetThreadUtilisation(table->entries[i].thread->tcb.cptr);
+        table->entries[i].cycles = 0;
+        table->entries[i].delta = 0;
+    }
+    table->total = 0;
+    table->total_delta = 0;
+    seL4_BenchmarkResetLog();
+}
+
+void sel4utils_utilisation_table_sample(sel4utils_utilisation_table_t *table)
+{
+    uint64_t *buffer = (uint64_t *) &seL4_GetIPCBuffer()->msg[0];
+
+    /* the kernel sets the end time of the total, and stops tracking, on finalise */
+    seL4_BenchmarkFinalizeLog();
+
+    for (size_t i = 0; i < table->num_entries; i++) {
+        sel4utils_thread_utilisation_t *entry = &table->entries[i];
+        seL4_BenchmarkGetThreadUtilisation(entry->thread->tcb.cptr);
+        uint64_t cycles = buffer[BENCHMARK_TCB_UTILISATION];
+        entry->delta = cycles - entry->cycles;
+        entry->cycles = cycles;
+        if (i == table->num_entries - 1) {
+            /* the kernel's total covers the time since the last reset, which is this interval */
+            table->total_delta = buffer[BENCHMARK_TOTAL_UTILISATION];
+            table->total += table->total_delta;
+        }
+    }
+
+    /* restart tracking, thread counters are kept until they are reset individually */
+    seL4_BenchmarkResetLog();
+}
+
+void sel4utils_utilisation_table_dump(sel4utils_utilisation_table_t *table)
+{
+    printf("%-20s %20s %8s %20s %8s\n", "thread", "cycles", "%", "last interval", "%");
+    for (size_t i = 0; i < table->num_entries; i++) {
+        sel4utils_thread_utilisation_t *entry = &table->entries[i];
+        printf("%-20s %20"PRIu64" %8.2f %20"PRIu64" %8.2f\n",
+               entry->name ? entry->name : "?",
+               entry->cycles, table->total ? 100.0 * entry->cycles / table->total : 0.0,
+               entry->delta, table->total_delta ? 100.0 * entry->delta / table->total_delta : 0.0);
+    }
+    printf("%-20s %20"PRIu64" %8s %20"PRIu64"\n", "total", table->total, "", table->total_delta);
+}
+
+#endif /* CONFIG_BENCHMARK_TRACK_UTILISATION */
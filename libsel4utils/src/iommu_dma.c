@@ -17,40 +17,363 @@
 #include <string.h>
 #include <utils/zf_log.h>
 
+/* IO virtual addresses are handed out below 4GiB so that devices limited to 32-bit
+ * DMA can be used on any platform. The first 1MiB is left unused so that a stray
+ * NULL based DMA faults */
+#define IOVA_BASE_PAGE 0x100ul
+#define IOVA_NUM_PAGES (0x100000ul - IOVA_BASE_PAGE)
+#define INITIAL_TABLE_SIZE 16
+
+/* A range of free IO virtual pages */
+typedef struct iova_range {
+    uintptr_t start;
+    size_t num_pages;
+} iova_range_t;
+
+/* A buffer registered with the dma manager. The buffer has a single IO virtual address
+ * that is valid in every iospace it gets mapped into, and is only mapped into an
+ * iospace while it holds references for it */
+typedef struct iommu_mapping {
+    uintptr_t buf;
+    size_t size;
+    /* page aligned start of the buffer */
+    uintptr_t vaddr;
+    size_t num_pages;
+    uintptr_t iova;
+    /* frames backing the buffer in the dma manager's vspace */
+    seL4_CPtr *frames;
+    /* per iospace copies of the frames, NULL while not mapped into that iospace */
+    seL4_CPtr **copies;
+    /* per iospace reference counts */
+    unsigned int *refs;
+    /* memory was allocated by dma_alloc and is released by dma_free */
+    bool owned;
+} iommu_mapping_t;
+
 typedef struct dma_man {
     vka_t vka;
     vspace_t vspace;
     int num_iospaces;
     vspace_t *iospaces;
     sel4utils_alloc_data_t *iospace_data;
+    /* IO virtual addresses are the vaddrs of the buffers, and buffers are mapped into
+     * every iospace as soon as they are allocated. Otherwise the fields below are used */
+    bool identity;
+    /* free IO virtual address ranges, sorted by start */
+    iova_range_t *iova_free;
+    size_t iova_num_free;
+    size_t iova_max_free;
+    /* registered buffers, sorted by buf */
+    iommu_mapping_t **mappings;
+    size_t num_mappings;
+    size_t max_mappings;
 } dma_man_t;
 
-static void unmap_range(dma_man_t *dma, uintptr_t addr, size_t size)
+static int grow_table(void **table, size_t *max, size_t entry_size)
+{
+    size_t new_max = *max ? *max * 2 : INITIAL_TABLE_SIZE;
+    void *new_table = realloc(*table, new_max * entry_size);
+    if (!new_table) {
+        ZF_LOGE("Failed to grow table to %zu entries", new_max);
+        return -1;
+    }
+    *table = new_table;
+    *max = new_max;
+    return 0;
+}
+
+/* First fit allocation of num_pages of IO virtual address space */
+static uintptr_t iova_alloc(dma_man_t *dma, size_t num_pages)
+{
+    for (size_t i = 0; i < dma->iova_num_free; i++) {
+        iova_range_t *range = &dma->iova_free[i];
+        if (range->num_pages < num_pages) {
+            continue;
+        }
+        uintptr_t iova = range->start * PAGE_SIZE_4K;
+        range->start += num_pages;
+        range->num_pages -= num_pages;
+        if (range->num_pages == 0) {
+            memmove(range, range + 1, (dma->iova_num_free - i - 1) * sizeof(*range));
+            dma->iova_num_free--;
+        }
+        return iova;
+    }
+    ZF_LOGE("Out of IO virtual address space for %zu pages", num_pages);
+    return 0;
+}
+
+static int iova_free(dma_man_t *dma, uintptr_t iova, size_t num_pages)
+{
+    uintptr_t start = iova / PAGE_SIZE_4K;
+    size_t i = 0;
+    while (i < dma->iova_num_free && dma->iova_free[i].start < start) {
+        i++;
+    }
+    bool merge_prev = i > 0 && dma->iova_free[i - 1].start + dma->iova_free[i - 1].num_pages == start;
+    bool merge_next = i < dma->iova_num_free && start + num_pages == dma->iova_free[i].start;
+    if (merge_prev && merge_next) {
+        dma->iova_free[i - 1].num_pages += num_pages + dma->iova_free[i].num_pages;
+        memmove(&dma->iova_free[i], &dma->iova_free[i + 1], (dma->iova_num_free - i - 1) * sizeof(iova_range_t));
+        dma->iova_num_free--;
+    } else if (merge_prev) {
+        dma->iova_free[i - 1].num_pages += num_pages;
+    } else if (merge_next) {
+        dma->iova_free[i].start = start;
+        dma->iova_free[i].num_pages += num_pages;
+    } else {
+        if (dma->iova_num_free == dma->iova_max_free &&
+            grow_table((void **)&dma->iova_free, &dma->iova_max_free, sizeof(iova_range_t))) {
+            return -1;
+        }
+        memmove(&dma->iova_free[i + 1], &dma->iova_free[i], (dma->iova_num_free - i) * sizeof(iova_range_t));
+        dma->iova_free[i] = (iova_range_t) {
+            .start = start, .num_pages = num_pages
+        };
+        dma->iova_num_free++;
+    }
+    return 0;
+}
+
+/* Returns the index of the first mapping whose buffer starts above addr */
+static size_t mapping_upper_bound(dma_man_t *dma, uintptr_t addr)
+{
+    size_t lo = 0;
+    size_t hi = dma->num_mappings;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dma->mappings[mid]->buf <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static iommu_mapping_t *mapping_find(dma_man_t *dma, void *addr)
+{
+    size_t i = mapping_upper_bound(dma, (uintptr_t)addr);
+    if (i == 0) {
+        return NULL;
+    }
+    iommu_mapping_t *mapping = dma->mappings[i - 1];
+    if ((uintptr_t)addr - mapping->buf >= MAX(mapping->size, 1)) {
+        return NULL;
+    }
+    return mapping;
+}
+
+static void unmap_iospace(dma_man_t *dma, iommu_mapping_t *mapping, int iospace)
+{
+    seL4_CPtr *copies = mapping->copies[iospace];
+    if (!copies) {
+        return;
+    }
+    vspace_unmap_pages(dma->iospaces + iospace, (void *)mapping->iova, mapping->num_pages, seL4_PageBits, NULL);
+    for (size_t i = 0; i < mapping->num_pages; i++) {
+        cspacepath_t path;
+        vka_cspace_make_path(&dma->vka, copies[i], &path);
+        vka_cnode_delete(&path);
+        vka_cspace_free(&dma->vka, copies[i]);
+    }
+    free(copies);
+    mapping->copies[iospace] = NULL;
+}
+
+/* Duplicates the frames of a buffer and maps the whole run into an iospace at once */
+static int map_iospace(dma_man_t *dma, iommu_mapping_t *mapping, int iospace)
+{
+    if (mapping->copies[iospace]) {
+        return 0;
+    }
+    seL4_CPtr *copies = calloc(mapping->num_pages, sizeof(seL4_CPtr));
+    if (!copies) {
+        ZF_LOGE("Failed to allocate frame cap list");
+        return -1;
+    }
+    size_t num_copied;
+    int error = 0;
+    for (num_copied = 0; num_copied < mapping->num_pages; num_copied++) {
+        cspacepath_t page_path, copy_path;
+        error = vka_cspace_alloc_path(&dma->vka, &copy_path);
+        if (error) {
+            ZF_LOGE("Failed to allocate slot");
+            break;
+        }
+        vka_cspace_make_path(&dma->vka, mapping->frames[num_copied], &page_path);
+        error = vka_cnode_copy(&copy_path, &page_path, seL4_AllRights);
+        if (error) {
+            ZF_LOGE("Failed to copy frame cap");
+            vka_cspace_free(&dma->vka, copy_path.capPtr);
+            break;
+        }
+        copies[num_copied] = copy_path.capPtr;
+    }
+    if (!error) {
+        reservation_t res = vspace_reserve_range_at(dma->iospaces + iospace, (void *)mapping->iova,
+                                                    mapping->num_pages * PAGE_SIZE_4K, seL4_AllRights, 1);
+        if (!res.res) {
+            ZF_LOGE("Failed to create a reservation");
+            error = -1;
+        } else {
+            error = vspace_map_pages_at_vaddr(dma->iospaces + iospace, copies, NULL, (void *)mapping->iova,
+                                              mapping->num_pages, seL4_PageBits, res);
+            if (error) {
+                ZF_LOGE("Failed to map frames into iospace");
+            }
+            vspace_free_reservation(dma->iospaces + iospace, res);
+        }
+    }
+    if (error) {
+        for (size_t i = 0; i < num_copied; i++) {
+            cspacepath_t path;
+            vka_cspace_make_path(&dma->vka, copies[i], &path);
+            vka_cnode_delete(&path);
+            vka_cspace_free(&dma->vka, copies[i]);
+        }
+        free(copies);
+        return -1;
+    }
+    mapping->copies[iospace] = copies;
+    return 0;
+}
+
+static int ref_iospace(dma_man_t *dma, iommu_mapping_t *mapping, int iospace)
+{
+    if (mapping->refs[iospace] == 0 && map_iospace(dma, mapping, iospace)) {
+        return -1;
+    }
+    mapping->refs[iospace]++;
+    return 0;
+}
+
+static void unref_iospace(dma_man_t *dma, iommu_mapping_t *mapping, int iospace)
+{
+    if (mapping->refs[iospace] == 0) {
+        ZF_LOGE("Unbalanced unpin of %p", (void *)mapping->buf);
+        return;
+    }
+    mapping->refs[iospace]--;
+    if (mapping->refs[iospace] == 0) {
+        unmap_iospace(dma, mapping, iospace);
+    }
+}
+
+static void mapping_destroy(dma_man_t *dma, iommu_mapping_t *mapping)
+{
+    /* copies is NULL if creating the mapping ran out of memory */
+    for (int i = 0; mapping->copies && i < dma->num_iospaces; i++) {
+        unmap_iospace(dma, mapping, i);
+    }
+    if (mapping->iova) {
+        iova_free(dma, mapping->iova, mapping->num_pages);
+    }
+    free(mapping->frames);
+    free(mapping->copies);
+    free(mapping->refs);
+    free(mapping);
+}
+
+static void mapping_remove(dma_man_t *dma, iommu_mapping_t *mapping)
+{
+    size_t i = mapping_upper_bound(dma, mapping->buf);
+    assert(i > 0 && dma->mappings[i - 1] == mapping);
+    i--;
+    memmove(&dma->mappings[i], &dma->mappings[i + 1], (dma->num_mappings - i - 1) * sizeof(*dma->mappings));
+    dma->num_mappings--;
+}
+
+/* Registers a buffer and gives it an IO virtual address, without mapping it anywhere yet */
+static iommu_mapping_t *mapping_create(dma_man_t *dma, void *vaddr, size_t size, bool owned)
+{
+    if (mapping_find(dma, vaddr)) {
+        ZF_LOGE("Buffer at %p is already registered with the dma manager", vaddr);
+        return NULL;
+    }
+    iommu_mapping_t *mapping = calloc(1, sizeof(*mapping));
+    if (!mapping) {
+        ZF_LOGE("Failed to allocate mapping");
+        return NULL;
+    }
+    mapping->buf = (uintptr_t)vaddr;
+    mapping->size = size;
+    mapping->owned = owned;
+    mapping->vaddr = ROUND_DOWN((uintptr_t)vaddr, PAGE_SIZE_4K);
+    mapping->num_pages = (ROUND_UP((uintptr_t)vaddr + MAX(size, 1), PAGE_SIZE_4K) - mapping->vaddr) / PAGE_SIZE_4K;
+    mapping->frames = calloc(mapping->num_pages, sizeof(seL4_CPtr));
+    mapping->copies = calloc(dma->num_iospaces, sizeof(seL4_CPtr *));
+    mapping->refs = calloc(dma->num_iospaces, sizeof(unsigned int));
+    if (!mapping->frames || !mapping->copies || !mapping->refs) {
+        ZF_LOGE("Failed to allocate mapping");
+        goto error;
+    }
+    /* find the frames that back the buffer */
+    for (size_t i = 0; i < mapping->num_pages; i++) {
+        void *addr = (void *)(mapping->vaddr + i * PAGE_SIZE_4K);
+        mapping->frames[i] = vspace_get_cap(&dma->vspace, addr);
+        if (!mapping->frames[i]) {
+            ZF_LOGE("Failed to retrieve frame cap for malloc region. "
+                    "Is your malloc backed by the correct vspace? "
+                    "If you allocated your own buffer, does the dma manager's vspace "
+                    "know about the caps to the frames that back the buffer?");
+            goto error;
+        }
+        if (i > 0 && mapping->frames[i] == mapping->frames[i - 1]) {
+            ZF_LOGE("Found the same frame two pages in a row. We only support 4K mappings");
+            goto error;
+        }
+    }
+    mapping->iova = iova_alloc(dma, mapping->num_pages);
+    if (!mapping->iova) {
+        goto error;
+    }
+    if (dma->num_mappings == dma->max_mappings &&
+        grow_table((void **)&dma->mappings, &dma->max_mappings, sizeof(*dma->mappings))) {
+        goto error;
+    }
+    size_t i = mapping_upper_bound(dma, mapping->buf);
+    memmove(&dma->mappings[i + 1], &dma->mappings[i], (dma->num_mappings - i) * sizeof(*dma->mappings));
+    dma->mappings[i] = mapping;
+    dma->num_mappings++;
+    return mapping;
+error:
+    mapping_destroy(dma, mapping);
+    return NULL;
+}
+
+/* Identity mapped managers map each page of a buffer at its vaddr. Buffers can share
+ * pages, so each page's iospace cookie counts the buffers using it */
+static void identity_unref_page(dma_man_t *dma, int iospace, uintptr_t addr)
+{
+    uintptr_t *cookie = (uintptr_t *)vspace_get_cookie(dma->iospaces + iospace, (void *)addr);
+    assert(cookie);
+    (*cookie)--;
+    if (*cookie == 0) {
+        seL4_CPtr page = vspace_get_cap(dma->iospaces + iospace, (void *)addr);
+        cspacepath_t page_path;
+        assert(page);
+        vspace_unmap_pages(dma->iospaces + iospace, (void *)addr, 1, seL4_PageBits, NULL);
+        vka_cspace_make_path(&dma->vka, page, &page_path);
+        vka_cnode_delete(&page_path);
+        vka_cspace_free(&dma->vka, page);
+        free(cookie);
+    }
+}
+
+static void identity_unmap_range(dma_man_t *dma, uintptr_t addr, size_t size)
 {
     uintptr_t start = ROUND_DOWN(addr, PAGE_SIZE_4K);
     uintptr_t end = addr + size;
     for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE_4K) {
         for (int i = 0; i < dma->num_iospaces; i++) {
-            uintptr_t *cookie = (uintptr_t *)vspace_get_cookie(dma->iospaces + i, (void *)addr);
-            assert(cookie);
-            (*cookie)--;
-            if (*cookie == 0) {
-                seL4_CPtr page = vspace_get_cap(dma->iospaces + i, (void *)addr);
-                cspacepath_t page_path;
-                assert(page);
-                vspace_unmap_pages(dma->iospaces + i, (void *)addr, 1, seL4_PageBits, NULL);
-                vka_cspace_make_path(&dma->vka, page, &page_path);
-                vka_cnode_delete(&page_path);
-                vka_cspace_free(&dma->vka, page);
-                free(cookie);
-            }
+            identity_unref_page(dma, i, addr);
         }
     }
 }
 
-int sel4utils_iommu_dma_alloc_iospace(void *cookie, void *vaddr, size_t size)
+static int identity_map_range(dma_man_t *dma, void *vaddr, size_t size)
 {
-    dma_man_t *dma = (dma_man_t *)cookie;
     int error;
 
     /* for each page duplicate and map it into all the iospaces */
@@ -65,78 +388,131 @@ int sel4utils_iommu_dma_alloc_iospace(void *cookie, void *vaddr, size_t size)
                     "Is your malloc backed by the correct vspace? "
                     "If you allocated your own buffer, does the dma manager's vspace "
                     "know about the caps to the frames that back the buffer?");
-            unmap_range(dma, start, addr + 1);
+            identity_unmap_range(dma, start, addr - start);
             return -1;
         }
         if (page == last_page) {
             ZF_LOGE("Found the same frame two pages in a row. We only support 4K mappings");
-            unmap_range(dma, start, addr + 1);
+            identity_unmap_range(dma, start, addr - start);
             return -1;
         }
         last_page = page;
         vka_cspace_make_path(&dma->vka, page, &page_path);
-        /* work out the size of this page */
         for (int i = 0; i < dma->num_iospaces; i++) {
             /* see if its already mapped */
             uintptr_t *cookie = (uintptr_t *)vspace_get_cookie(dma->iospaces + i, (void *)addr);
             if (cookie) {
                 /* increment the counter */
                 (*cookie)++;
-            } else {
-                cspacepath_t copy_path;
-                /* allocate slot for the cap */
-                error = vka_cspace_alloc_path(&dma->vka, &copy_path);
-                if (error) {
-                    ZF_LOGE("Failed to allocate slot");
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                /* copy the cap */
-                error = vka_cnode_copy(&copy_path, &page_path, seL4_AllRights);
-                if (error) {
-                    ZF_LOGE("Failed to copy frame cap");
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                /* now map it in */
-                reservation_t res = vspace_reserve_range_at(dma->iospaces + i, (void *)addr, PAGE_SIZE_4K, seL4_AllRights, 1);
-                if (!res.res) {
-                    ZF_LOGE("Failed to create a reservation");
-                    vka_cnode_delete(&copy_path);
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                cookie = malloc(sizeof(*cookie));
-                if (!cookie) {
-                    ZF_LOGE("Failed to malloc %zu bytes", sizeof(*cookie));
-                    vspace_free_reservation(dma->iospaces + i, res);
-                    vka_cnode_delete(&copy_path);
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                *cookie = 1;
-                error = vspace_map_pages_at_vaddr(dma->iospaces + i, &copy_path.capPtr, (uintptr_t *)&cookie, (void *)addr, 1,
-                                                  seL4_PageBits, res);
-                if (error) {
-                    ZF_LOGE("Failed to map frame into iospace");
-                    free(cookie);
-                    vspace_free_reservation(dma->iospaces + i, res);
-                    vka_cnode_delete(&copy_path);
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
+                continue;
+            }
+            cspacepath_t copy_path;
+            error = vka_cspace_alloc_path(&dma->vka, &copy_path);
+            if (error) {
+                ZF_LOGE("Failed to allocate slot");
+                goto error;
+            }
+            error = vka_cnode_copy(&copy_path, &page_path, seL4_AllRights);
+            if (error) {
+                ZF_LOGE("Failed to copy frame cap");
+                vka_cspace_free(&dma->vka, copy_path.capPtr);
+                goto error;
+            }
+            reservation_t res = vspace_reserve_range_at(dma->iospaces + i, (void *)addr, PAGE_SIZE_4K,
+                                                        seL4_AllRights, 1);
+            if (!res.res) {
+                ZF_LOGE("Failed to create a reservation");
+                goto error_copy;
+            }
+            cookie = malloc(sizeof(*cookie));
+            if (!cookie) {
+                ZF_LOGE("Failed to malloc %zu bytes", sizeof(*cookie));
                 vspace_free_reservation(dma->iospaces + i, res);
+                goto error_copy;
             }
+            *cookie = 1;
+            error = vspace_map_pages_at_vaddr(dma->iospaces + i, &copy_path.capPtr, (uintptr_t *)&cookie,
+                                              (void *)addr, 1, seL4_PageBits, res);
+            vspace_free_reservation(dma->iospaces + i, res);
+            if (error) {
+                ZF_LOGE("Failed to map frame into iospace");
+                free(cookie);
+                goto error_copy;
+            }
+            continue;
+error_copy:
+            vka_cnode_delete(&copy_path);
+            vka_cspace_free(&dma->vka, copy_path.capPtr);
+error:
+            /* drop this page from the iospaces it was already added to, then the earlier pages */
+            for (int j = 0; j < i; j++) {
+                identity_unref_page(dma, j, addr);
+            }
+            identity_unmap_range(dma, start, addr - start);
+            return -1;
         }
     }
 
     return 0;
 }
 
+int sel4utils_iommu_dma_alloc_iospace(void *cookie, void *vaddr, size_t size)
+{
+    dma_man_t *dma = (dma_man_t *)cookie;
+    if (dma->identity) {
+        return identity_map_range(dma, vaddr, size);
+    }
+    iommu_mapping_t *mapping = mapping_create(dma, vaddr, size, false);
+    if (!mapping) {
+        return -1;
+    }
+    /* the registration itself holds a reference in every iospace */
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        if (ref_iospace(dma, mapping, i)) {
+            mapping_remove(dma, mapping);
+            mapping_destroy(dma, mapping);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uintptr_t sel4utils_iommu_dma_pin_iospace(void *cookie, int iospace, void *vaddr)
+{
+    dma_man_t *dma = (dma_man_t *)cookie;
+    if (iospace < 0 || iospace >= dma->num_iospaces) {
+        ZF_LOGE("Invalid iospace %d", iospace);
+        return 0;
+    }
+    if (dma->identity) {
+        /* already mapped into every iospace */
+        return (uintptr_t)vaddr;
+    }
+    iommu_mapping_t *mapping = mapping_find(dma, vaddr);
+    if (!mapping) {
+        ZF_LOGE("%p is not registered with the dma manager", vaddr);
+        return 0;
+    }
+    if (ref_iospace(dma, mapping, iospace)) {
+        return 0;
+    }
+    return mapping->iova + ((uintptr_t)vaddr - mapping->vaddr);
+}
+
+void sel4utils_iommu_dma_unpin_iospace(void *cookie, int iospace, void *vaddr)
+{
+    dma_man_t *dma = (dma_man_t *)cookie;
+    if (dma->identity) {
+        return;
+    }
+    iommu_mapping_t *mapping = mapping_find(dma, vaddr);
+    if (!mapping || iospace < 0 || iospace >= dma->num_iospaces) {
+        ZF_LOGE("%p is not registered with the dma manager", vaddr);
+        return;
+    }
+    unref_iospace(dma, mapping, iospace);
+}
+
 static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
 {
     int error;
@@ -147,8 +523,8 @@ static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_
         if (error) {
             return NULL;
         }
-        error = sel4utils_iommu_dma_alloc_iospace(cookie, ret, size);
-        if (error) {
+        /* the buffer only gets mapped into an iospace once it is pinned */
+        if (!mapping_create(cookie, ret, size, true)) {
             free(ret);
             return NULL;
         }
@@ -163,16 +539,88 @@ static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_
 static void dma_free(void *cookie, void *addr, size_t size)
 {
     dma_man_t *dma = cookie;
-    unmap_range(dma, (uintptr_t)addr, size);
-    free(addr);
+    iommu_mapping_t *mapping = mapping_find(dma, addr);
+    if (!mapping) {
+        ZF_LOGE("%p is not registered with the dma manager", addr);
+        return;
+    }
+    bool owned = mapping->owned;
+    mapping_remove(dma, mapping);
+    mapping_destroy(dma, mapping);
+    if (owned) {
+        free(addr);
+    }
 }
 
 static uintptr_t dma_pin(void *cookie, void *addr, size_t size)
 {
-    return (uintptr_t)addr;
+    dma_man_t *dma = cookie;
+    iommu_mapping_t *mapping = mapping_find(dma, addr);
+    if (!mapping) {
+        ZF_LOGE("%p is not registered with the dma manager", addr);
+        return 0;
+    }
+    /* a pin without a device makes the buffer visible to all of them */
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        if (ref_iospace(dma, mapping, i)) {
+            while (i-- > 0) {
+                unref_iospace(dma, mapping, i);
+            }
+            return 0;
+        }
+    }
+    return mapping->iova + ((uintptr_t)addr - mapping->vaddr);
 }
 
 static void dma_unpin(void *cookie, void *addr, size_t size)
+{
+    dma_man_t *dma = cookie;
+    iommu_mapping_t *mapping = mapping_find(dma, addr);
+    if (!mapping) {
+        ZF_LOGE("%p is not registered with the dma manager", addr);
+        return;
+    }
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        unref_iospace(dma, mapping, i);
+    }
+}
+
+static void *identity_dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+{
+    int error;
+    if (cached || flags != PS_MEM_NORMAL) {
+        /* Going to ignore flags */
+        void *ret;
+        error = posix_memalign(&ret, align, size);
+        if (error) {
+            return NULL;
+        }
+        error = identity_map_range(cookie, ret, size);
+        if (error) {
+            free(ret);
+            return NULL;
+        }
+        return ret;
+    } else {
+        /* do not support uncached memory */
+        ZF_LOGE("Only support cached normal memory");
+        return NULL;
+    }
+}
+
+static void identity_dma_free(void *cookie, void *addr, size_t size)
+{
+    dma_man_t *dma = cookie;
+    identity_unmap_range(dma, (uintptr_t)addr, size);
+    free(addr);
+}
+
+static uintptr_t identity_dma_pin(void *cookie, void *addr, size_t size)
+{
+    return (uintptr_t)addr;
+}
+
+static void identity_dma_unpin(void *cookie, void *addr, size_t size)
 {
 }
 
@@ -187,8 +635,8 @@ static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t o
 #endif
 }
 
-int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man, unsigned int num_iospaces,
-                                   seL4_CPtr *iospaces)
+static int make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man, unsigned int num_iospaces,
+                                seL4_CPtr *iospaces, bool identity)
 {
     dma_man_t *dma = calloc(1, sizeof(*dma));
     if (!dma) {
@@ -197,11 +645,19 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
     dma->num_iospaces = num_iospaces;
     dma->vka = *vka;
     dma->vspace = *vspace;
+    dma->identity = identity;
     dma_man->cookie = dma;
-    dma_man->dma_alloc_fn = dma_alloc;
-    dma_man->dma_free_fn = dma_free;
-    dma_man->dma_pin_fn = dma_pin;
-    dma_man->dma_unpin_fn = dma_unpin;
+    if (identity) {
+        dma_man->dma_alloc_fn = identity_dma_alloc;
+        dma_man->dma_free_fn = identity_dma_free;
+        dma_man->dma_pin_fn = identity_dma_pin;
+        dma_man->dma_unpin_fn = identity_dma_unpin;
+    } else {
+        dma_man->dma_alloc_fn = dma_alloc;
+        dma_man->dma_free_fn = dma_free;
+        dma_man->dma_pin_fn = dma_pin;
+        dma_man->dma_unpin_fn = dma_unpin;
+    }
     dma_man->dma_cache_op_fn = dma_cache_op;
 
     dma->iospaces = malloc(sizeof(vspace_t) * num_iospaces);
@@ -212,6 +668,15 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
     if (!dma->iospace_data) {
         goto error;
     }
+    dma->iova_free = malloc(sizeof(iova_range_t) * INITIAL_TABLE_SIZE);
+    if (!dma->iova_free) {
+        goto error;
+    }
+    dma->iova_free[0] = (iova_range_t) {
+        .start = IOVA_BASE_PAGE, .num_pages = IOVA_NUM_PAGES
+    };
+    dma->iova_num_free = 1;
+    dma->iova_max_free = INITIAL_TABLE_SIZE;
     for (unsigned int i = 0; i < num_iospaces; i++) {
         int err = sel4utils_get_vspace_with_map(&dma->vspace, dma->iospaces + i, dma->iospace_data + i, &dma->vka, iospaces[i],
                                                 NULL, NULL, sel4utils_map_page_iommu);
@@ -224,6 +689,9 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
     }
     return 0;
 error:
+    if (dma->iova_free) {
+        free(dma->iova_free);
+    }
     if (dma->iospace_data) {
         free(dma->iospace_data);
     }
@@ -236,4 +704,16 @@ error:
     return -1;
 }
 
+int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man, unsigned int num_iospaces,
+                                   seL4_CPtr *iospaces)
+{
+    return make_iommu_dma_alloc(vka, vspace, dma_man, num_iospaces, iospaces, true);
+}
+
+int sel4utils_make_iommu_dma_alloc_iova(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man,
+                                        unsigned int num_iospaces, seL4_CPtr *iospaces)
+{
+    return make_iommu_dma_alloc(vka, vspace, dma_man, num_iospaces, iospaces, false);
+}
+
 #endif /* CONFIG_IOMMU */
@@ -16,174 +16,385 @@
 #include <string.h>
 #include <sel4utils/arch/cache.h>
 
+/* Smallest buffer handed out by a pool, large enough to hold a free list link */
+#define DMA_POOL_MIN_BITS 6
+/* Pools cover every power of 2 size below a page, anything larger gets its own region */
+#define DMA_POOL_NUM_CLASSES (seL4_PageBits - DMA_POOL_MIN_BITS)
+#define DMA_INITIAL_REGIONS 16
+
+/* A physically contiguous, virtually contiguous mapping backed by a single untyped */
+typedef struct dma_region {
+    void *base;
+    size_t size;
+    uintptr_t paddr;
+    vka_object_t ut;
+    size_t frame_bits;
+    seL4_CPtr *frames;
+    /* size class this region was carved into, or -1 if it is a single allocation */
+    int pool_class;
+    int cached;
+    /* device accesses to this region are coherent, so no cache maintenance is needed */
+    bool coherent;
+} dma_region_t;
+
+/* Free pool buffers are linked through their own memory */
+typedef struct dma_pool_buf {
+    struct dma_pool_buf *next;
+} dma_pool_buf_t;
+
+typedef struct dma_pool {
+    dma_pool_buf_t *free_list;
+    size_t num_free;
+} dma_pool_t;
+
 typedef struct dma_man {
     vka_t vka;
     vspace_t vspace;
+    /* all regions, sorted by base address, so that translation never walks the vspace */
+    dma_region_t **regions;
+    size_t num_regions;
+    size_t max_regions;
+    /* 0 if pooling is disabled */
+    size_t chunk_bits;
+    /* all device accesses are coherent, so cache maintenance is skipped entirely */
+    bool coherent;
+    /* separate pools for uncached and cached buffers */
+    dma_pool_t pools[2][DMA_POOL_NUM_CLASSES];
 } dma_man_t;
 
-typedef struct dma_alloc {
-    void *base;
-    vka_object_t ut;
-    uintptr_t paddr;
-} dma_alloc_t;
+static size_t size_to_bits(size_t size)
+{
+    size_t size_bits = LOG_BASE_2(size);
+    if (BIT(size_bits) != size) {
+        size_bits++;
+    }
+    return size_bits;
+}
 
-static void dma_free(void *cookie, void *addr, size_t size)
+/* Returns the index of the first region whose base is above addr */
+static size_t region_upper_bound(dma_man_t *dma, uintptr_t addr)
 {
-    dma_man_t *dma = cookie;
-    dma_alloc_t *alloc = (dma_alloc_t *)vspace_get_cookie(&dma->vspace, addr);
-    assert(alloc);
-    assert(alloc->base == addr);
-    int num_pages = BIT(alloc->ut.size_bits) / PAGE_SIZE_4K;
-    for (int i = 0; i < num_pages; i++) {
-        cspacepath_t path;
-        seL4_CPtr frame = vspace_get_cap(&dma->vspace, addr + i * PAGE_SIZE_4K);
-        vspace_unmap_pages(&dma->vspace, addr + i * PAGE_SIZE_4K, 1, PAGE_BITS_4K, NULL);
-        vka_cspace_make_path(&dma->vka, frame, &path);
-        vka_cnode_delete(&path);
-        vka_cspace_free(&dma->vka, frame);
+    size_t lo = 0;
+    size_t hi = dma->num_regions;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)dma->regions[mid]->base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    vka_free_object(&dma->vka, &alloc->ut);
-    free(alloc);
+    return lo;
 }
 
-static uintptr_t dma_pin(void *cookie, void *addr, size_t size)
+static dma_region_t *region_find(dma_man_t *dma, void *addr)
 {
-    dma_man_t *dma = cookie;
-    dma_alloc_t *alloc = (dma_alloc_t *)vspace_get_cookie(&dma->vspace, addr);
-    if (!alloc) {
-        return 0;
+    size_t i = region_upper_bound(dma, (uintptr_t)addr);
+    if (i == 0) {
+        return NULL;
     }
-    uint32_t diff = addr - alloc->base;
-    return alloc->paddr + diff;
+    dma_region_t *region = dma->regions[i - 1];
+    if ((uintptr_t)addr - (uintptr_t)region->base >= region->size) {
+        return NULL;
+    }
+    return region;
 }
 
-static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+static int region_insert(dma_man_t *dma, dma_region_t *region)
+{
+    if (dma->num_regions == dma->max_regions) {
+        size_t max_regions = dma->max_regions ? dma->max_regions * 2 : DMA_INITIAL_REGIONS;
+        dma_region_t **regions = realloc(dma->regions, max_regions * sizeof(*regions));
+        if (!regions) {
+            ZF_LOGE("Failed to grow dma region table");
+            return -1;
+        }
+        dma->regions = regions;
+        dma->max_regions = max_regions;
+    }
+    size_t i = region_upper_bound(dma, (uintptr_t)region->base);
+    memmove(&dma->regions[i + 1], &dma->regions[i], (dma->num_regions - i) * sizeof(*dma->regions));
+    dma->regions[i] = region;
+    dma->num_regions++;
+    return 0;
+}
+
+static void region_remove(dma_man_t *dma, dma_region_t *region)
+{
+    size_t i = region_upper_bound(dma, (uintptr_t)region->base);
+    assert(i > 0 && dma->regions[i - 1] == region);
+    i--;
+    memmove(&dma->regions[i], &dma->regions[i + 1], (dma->num_regions - i - 1) * sizeof(*dma->regions));
+    dma->num_regions--;
+}
+
+static void region_free_frames(dma_man_t *dma, dma_region_t *region, size_t num_frames)
+{
+    for (size_t i = 0; i < num_frames; i++) {
+        if (region->frames[i]) {
+            cspacepath_t path;
+            vka_cspace_make_path(&dma->vka, region->frames[i], &path);
+            vka_cnode_delete(&path);
+            vka_cspace_free(&dma->vka, region->frames[i]);
+        }
+    }
+}
+
+static void region_free(dma_man_t *dma, dma_region_t *region)
+{
+    size_t num_frames = region->size >> region->frame_bits;
+    region_remove(dma, region);
+    vspace_unmap_pages(&dma->vspace, region->base, num_frames, region->frame_bits, NULL);
+    region_free_frames(dma, region, num_frames);
+    vka_free_object(&dma->vka, &region->ut);
+    free(region->frames);
+    free(region);
+}
+
+/* Allocates a region of BIT(size_bits) bytes, aligned both physically and virtually to
+ * BIT(align_bits). Regions of at least a large page are mapped with large pages */
+static dma_region_t *region_alloc(dma_man_t *dma, size_t size_bits, size_t align_bits, int cached)
 {
-    dma_man_t *dma = cookie;
-    cspacepath_t *frames = NULL;
     reservation_t res = {NULL};
-    dma_alloc_t *alloc = NULL;
-    unsigned int num_frames = 0;
-    void *base = NULL;
-    /* We align to the 4K boundary, but do not support more */
-    if (align > PAGE_SIZE_4K) {
+    size_t frame_bits = size_bits >= seL4_LargePageBits ? seL4_LargePageBits : seL4_PageBits;
+    size_t num_frames = BIT(size_bits - frame_bits);
+    assert(align_bits <= size_bits);
+
+    dma_region_t *region = calloc(1, sizeof(*region));
+    if (!region) {
         return NULL;
     }
-    /* Round up to the next page size */
-    size = ROUND_UP(size, PAGE_SIZE_4K);
-    /* Then round up to the next power of 2 size. This is because untypeds are allocated
-     * in powers of 2 */
-    size_t size_bits = LOG_BASE_2(size);
-    if (BIT(size_bits) != size) {
-        size_bits++;
+    region->size = BIT(size_bits);
+    region->frame_bits = frame_bits;
+    region->pool_class = -1;
+    region->cached = cached;
+    region->frames = calloc(num_frames, sizeof(seL4_CPtr));
+    if (!region->frames) {
+        free(region);
+        return NULL;
     }
-    size = BIT(size_bits);
-    /* Allocate an untyped */
-    vka_object_t ut;
-    int error = vka_alloc_untyped(&dma->vka, size_bits, &ut);
+    /* Allocate an untyped, which is physically aligned to its size */
+    int error = vka_alloc_untyped(&dma->vka, size_bits, &region->ut);
     if (error) {
         ZF_LOGE("Failed to allocate untyped of size %zu", size_bits);
+        free(region->frames);
+        free(region);
         return NULL;
     }
-    /* Get the physical address */
-    uintptr_t paddr = vka_utspace_paddr(&dma->vka, ut.ut, seL4_UntypedObject, size_bits);
-    if (paddr == VKA_NO_PADDR) {
+    region->paddr = vka_utspace_paddr(&dma->vka, region->ut.ut, seL4_UntypedObject, size_bits);
+    if (region->paddr == VKA_NO_PADDR) {
         ZF_LOGE("Allocated untyped has no physical address");
         goto handle_error;
     }
     /* Allocate all the frames */
-    num_frames = size / PAGE_SIZE_4K;
-    frames = calloc(num_frames, sizeof(cspacepath_t));
-    if (!frames) {
-        goto handle_error;
-    }
-    for (unsigned i = 0; i < num_frames; i++) {
-        error = vka_cspace_alloc_path(&dma->vka, &frames[i]);
+    seL4_Word frame_type = kobject_get_type(KOBJECT_FRAME, frame_bits);
+    for (size_t i = 0; i < num_frames; i++) {
+        cspacepath_t path;
+        error = vka_cspace_alloc_path(&dma->vka, &path);
         if (error) {
             goto handle_error;
         }
-        error = seL4_Untyped_Retype(ut.cptr, kobject_get_type(KOBJECT_FRAME, PAGE_BITS_4K), size_bits, frames[i].root,
-                                    frames[i].dest, frames[i].destDepth, frames[i].offset, 1);
+        error = seL4_Untyped_Retype(region->ut.cptr, frame_type, frame_bits, path.root, path.dest, path.destDepth,
+                                    path.offset, 1);
         if (error != seL4_NoError) {
+            vka_cspace_free(&dma->vka, path.capPtr);
             goto handle_error;
         }
+        region->frames[i] = path.capPtr;
     }
-    /* Grab a reservation */
-    res = vspace_reserve_range(&dma->vspace, size, seL4_AllRights, cached, &base);
+    /* Grab a reservation, padded so that the mapping can be aligned beyond the frame size */
+    size_t pad = align_bits > frame_bits ? BIT(align_bits) - BIT(frame_bits) : 0;
+    void *vaddr = NULL;
+    res = vspace_reserve_range_aligned(&dma->vspace, region->size + pad, frame_bits, seL4_AllRights, cached, &vaddr);
     if (!res.res) {
         ZF_LOGE("Failed to reserve");
-        return NULL;
-    }
-    alloc = malloc(sizeof(*alloc));
-    if (alloc == NULL) {
         goto handle_error;
     }
-    alloc->base = base;
-    alloc->ut = ut;
-    alloc->paddr = paddr;
-    /* Map in all the pages */
-    for (unsigned i = 0; i < num_frames; i++) {
-        error = vspace_map_pages_at_vaddr(&dma->vspace, &frames[i].capPtr, (uintptr_t *)&alloc, base + i * PAGE_SIZE_4K, 1,
-                                          PAGE_BITS_4K, res);
-        if (error) {
-            goto handle_error;
-        }
+    region->base = (void *)ROUND_UP((uintptr_t)vaddr, BIT(align_bits));
+    /* Map everything in one go */
+    error = vspace_map_pages_at_vaddr(&dma->vspace, region->frames, NULL, region->base, num_frames, frame_bits, res);
+    if (error) {
+        ZF_LOGE("Failed to map dma region");
+        goto handle_error;
     }
     /* no longer need the reservation */
     vspace_free_reservation(&dma->vspace, res);
-    return base;
-handle_error:
-    if (alloc) {
-        free(alloc);
+    res.res = NULL;
+    if (region_insert(dma, region)) {
+        vspace_unmap_pages(&dma->vspace, region->base, num_frames, frame_bits, NULL);
+        goto handle_error;
     }
+    return region;
+handle_error:
     if (res.res) {
-        vspace_unmap_pages(&dma->vspace, base, num_frames, PAGE_BITS_4K, NULL);
         vspace_free_reservation(&dma->vspace, res);
     }
-    if (frames) {
-        for (int i = 0; i < num_frames; i++) {
-            if (frames[i].capPtr) {
-                vka_cnode_delete(&frames[i]);
-                vka_cspace_free(&dma->vka, frames[i].capPtr);
-            }
-        }
-        free(frames);
-    }
-    vka_free_object(&dma->vka, &ut);
+    region_free_frames(dma, region, num_frames);
+    vka_free_object(&dma->vka, &region->ut);
+    free(region->frames);
+    free(region);
     return NULL;
 }
 
-static void dma_unpin(void *cookie, void *addr, size_t size)
+/* Carves a new chunk into buffers of the given class and puts them on the free list */
+static int pool_grow(dma_man_t *dma, int cached, int pool_class)
+{
+    size_t buf_bits = pool_class + DMA_POOL_MIN_BITS;
+    dma_region_t *region = region_alloc(dma, dma->chunk_bits, seL4_PageBits, cached);
+    if (!region) {
+        return -1;
+    }
+    region->pool_class = pool_class;
+    dma_pool_t *pool = &dma->pools[!!cached][pool_class];
+    size_t num_bufs = BIT(dma->chunk_bits - buf_bits);
+    /* Push in reverse so that buffers are handed out in address order */
+    for (size_t i = num_bufs; i > 0; i--) {
+        dma_pool_buf_t *buf = region->base + ((i - 1) << buf_bits);
+        buf->next = pool->free_list;
+        pool->free_list = buf;
+    }
+    pool->num_free += num_bufs;
+    return 0;
+}
+
+static void *pool_alloc(dma_man_t *dma, int cached, int pool_class)
 {
+    dma_pool_t *pool = &dma->pools[!!cached][pool_class];
+    if (!pool->free_list && pool_grow(dma, cached, pool_class)) {
+        return NULL;
+    }
+    dma_pool_buf_t *buf = pool->free_list;
+    pool->free_list = buf->next;
+    pool->num_free--;
+    return buf;
 }
 
-static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+/* Returns the pool class that can satisfy a request, or -1 if it needs its own region */
+static int pool_class_for(dma_man_t *dma, size_t size, size_t align)
+{
+    if (!dma->chunk_bits || size == 0 || size >= PAGE_SIZE_4K || align >= PAGE_SIZE_4K) {
+        return -1;
+    }
+    size_t bits = MAX(size_to_bits(size), (size_t)DMA_POOL_MIN_BITS);
+    if (align > 0) {
+        bits = MAX(bits, size_to_bits(align));
+    }
+    if (bits >= seL4_PageBits) {
+        return -1;
+    }
+    return bits - DMA_POOL_MIN_BITS;
+}
+
+static void dma_free(void *cookie, void *addr, size_t size)
 {
     dma_man_t *dma = cookie;
-    seL4_CPtr root = vspace_get_root(&dma->vspace);
-    uintptr_t end = (uintptr_t)addr + size;
-    uintptr_t cur = (uintptr_t)addr;
+    dma_region_t *region = region_find(dma, addr);
+    assert(region);
+    if (!region) {
+        ZF_LOGE("Freeing unknown dma address %p", addr);
+        return;
+    }
+    if (region->pool_class >= 0) {
+        /* Pool chunks are never released, the buffer just goes back on its free list */
+        dma_pool_t *pool = &dma->pools[!!region->cached][region->pool_class];
+        dma_pool_buf_t *buf = addr;
+        buf->next = pool->free_list;
+        pool->free_list = buf;
+        pool->num_free++;
+        return;
+    }
+    assert(region->base == addr);
+    region_free(dma, region);
+}
+
+static uintptr_t dma_pin(void *cookie, void *addr, size_t size)
+{
+    dma_man_t *dma = cookie;
+    dma_region_t *region = region_find(dma, addr);
+    if (!region) {
+        return 0;
+    }
+    return region->paddr + ((uintptr_t)addr - (uintptr_t)region->base);
+}
+
+static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+{
+    dma_man_t *dma = cookie;
+    if (align < 0 || (align & (align - 1))) {
+        ZF_LOGE("Alignment %d is not a power of 2", align);
+        return NULL;
+    }
+    int pool_class = pool_class_for(dma, size, align);
+    if (pool_class >= 0) {
+        return pool_alloc(dma, cached, pool_class);
+    }
+    /* Round up to the next page size, and at least the alignment */
+    size = MAX(ROUND_UP(size, PAGE_SIZE_4K), (size_t)align);
+    /* Then round up to the next power of 2 size. This is because untypeds are allocated
+     * in powers of 2 */
+    size_t size_bits = size_to_bits(size);
+    size_t align_bits = align > PAGE_SIZE_4K ? size_to_bits(align) : seL4_PageBits;
+    dma_region_t *region = region_alloc(dma, size_bits, align_bits, cached);
+    if (!region) {
+        return NULL;
+    }
+    return region->base;
+}
+
+static void dma_unpin(void *cookie, void *addr, size_t size)
+{
+}
+
+static void cache_op(seL4_CPtr root, uintptr_t start, uintptr_t end, dma_cache_op_t op)
+{
+    switch (op) {
+    case DMA_CACHE_OP_CLEAN:
+        seL4_ARCH_PageDirectory_Clean_Data(root, (seL4_Word)start, (seL4_Word)end);
+        break;
+    case DMA_CACHE_OP_INVALIDATE:
+        seL4_ARCH_PageDirectory_Invalidate_Data(root, (seL4_Word)start, (seL4_Word)end);
+        break;
+    case DMA_CACHE_OP_CLEAN_INVALIDATE:
+        seL4_ARCH_PageDirectory_CleanInvalidate_Data(root, (seL4_Word)start, (seL4_Word)end);
+        break;
+    }
+}
+
+/* The kernel only accepts a cache maintenance range that lies within a single frame, so
+ * ranges are split at the frame boundaries of the mapping they fall in. Ranges in regions
+ * that are coherent or mapped uncached need no maintenance at all */
+static void cache_op_range(dma_man_t *dma, seL4_CPtr root, uintptr_t cur, uintptr_t end, dma_cache_op_t op)
+{
     while (cur < end) {
-        uintptr_t top = ROUND_UP(cur + 1, PAGE_SIZE_4K);
-        if (top > end) {
-            top = end;
+        dma_region_t *region = region_find(dma, (void *)cur);
+        size_t frame_size = PAGE_SIZE_4K;
+        uintptr_t limit = end;
+        if (region) {
+            limit = MIN(end, (uintptr_t)region->base + region->size);
+            if (region->coherent || !region->cached) {
+                cur = limit;
+                continue;
+            }
+            frame_size = BIT(region->frame_bits);
         }
-        switch (op) {
-        case DMA_CACHE_OP_CLEAN:
-            seL4_ARCH_PageDirectory_Clean_Data(root, (seL4_Word)cur, (seL4_Word)top);
-            break;
-        case DMA_CACHE_OP_INVALIDATE:
-            seL4_ARCH_PageDirectory_Invalidate_Data(root, (seL4_Word)cur, (seL4_Word)top);
-            break;
-        case DMA_CACHE_OP_CLEAN_INVALIDATE:
-            seL4_ARCH_PageDirectory_CleanInvalidate_Data(root, (seL4_Word)cur, (seL4_Word)top);
-            break;
+        while (cur < limit) {
+            uintptr_t top = MIN(ROUND_UP(cur + 1, frame_size), limit);
+            cache_op(root, cur, top, op);
+            cur = top;
         }
-        cur = top;
     }
 }
 
-int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man)
+static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+    dma_man_t *dma = cookie;
+    if (dma->coherent) {
+        return;
+    }
+    cache_op_range(dma, vspace_get_root(&dma->vspace), (uintptr_t)addr, (uintptr_t)addr + size, op);
+}
+
+static int new_page_dma(vka_t *vka, vspace_t *vspace, size_t chunk_bits, ps_dma_man_t *dma_man)
 {
     dma_man_t *dma = calloc(1, sizeof(*dma));
     if (!dma) {
@@ -191,6 +402,7 @@ int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma
     }
     dma->vka = *vka;
     dma->vspace = *vspace;
+    dma->chunk_bits = chunk_bits;
     dma_man->cookie = dma;
     dma_man->dma_alloc_fn = dma_alloc;
     dma_man->dma_free_fn = dma_free;
@@ -199,3 +411,80 @@ int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma
     dma_man->dma_cache_op_fn = dma_cache_op;
     return 0;
 }
+
+int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man)
+{
+    return new_page_dma(vka, vspace, 0, dma_man);
+}
+
+int sel4utils_new_page_dma_pool_alloc(vka_t *vka, vspace_t *vspace, size_t chunk_size_bits, ps_dma_man_t *dma_man)
+{
+    if (chunk_size_bits < seL4_PageBits) {
+        ZF_LOGE("Pool chunks must be at least a page, got %zu bits", chunk_size_bits);
+        return -1;
+    }
+    return new_page_dma(vka, vspace, chunk_size_bits, dma_man);
+}
+
+int sel4utils_page_dma_pool_prefill(ps_dma_man_t *dma_man, size_t size, int cached, size_t count)
+{
+    dma_man_t *dma = dma_man->cookie;
+    int pool_class = pool_class_for(dma, size, 0);
+    if (pool_class < 0) {
+        ZF_LOGE("Size %zu is not served from a pool", size);
+        return -1;
+    }
+    while (dma->pools[!!cached][pool_class].num_free < count) {
+        if (pool_grow(dma, cached, pool_class)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sel4utils_page_dma_cache_op_sg(ps_dma_man_t *dma_man, const sel4utils_dma_sg_t *sg, size_t num_sg,
+                                    dma_cache_op_t op)
+{
+    dma_man_t *dma = dma_man->cookie;
+    if (dma->coherent || num_sg == 0) {
+        return;
+    }
+    seL4_CPtr root = vspace_get_root(&dma->vspace);
+    uintptr_t start = (uintptr_t)sg[0].addr;
+    uintptr_t end = start + sg[0].len;
+    for (size_t i = 1; i < num_sg; i++) {
+        uintptr_t addr = (uintptr_t)sg[i].addr;
+        /* Only merge entries that are virtually adjacent. Covering a gap could invalidate
+         * memory that does not belong to the transfer */
+        if (addr == end) {
+            end += sg[i].len;
+            continue;
+        }
+        cache_op_range(dma, root, start, end, op);
+        start = addr;
+        end = addr + sg[i].len;
+    }
+    cache_op_range(dma, root, start, end, op);
+}
+
+void sel4utils_page_dma_set_coherent(ps_dma_man_t *dma_man, bool coherent)
+{
+    dma_man_t *dma = dma_man->cookie;
+    dma->coherent = coherent;
+}
+
+int sel4utils_page_dma_set_buffer_coherent(ps_dma_man_t *dma_man, void *addr, bool coherent)
+{
+    dma_man_t *dma = dma_man->cookie;
+    dma_region_t *region = region_find(dma, addr);
+    if (!region || region->base != addr) {
+        ZF_LOGE("%p is not the start of a dma allocation", addr);
+        return -1;
+    }
+    if (region->pool_class >= 0) {
+        ZF_LOGE("Pool buffers share their chunk and cannot be marked coherent individually");
+        return -1;
+    }
+    region->coherent = coherent;
+    return 0;
+}
@@ -29,25 +29,91 @@
 extern char _cpio_archive[];
 extern char _cpio_archive_end[];
 
-void sel4utils_allocated_object(void *cookie, vka_object_t object)
-{
-    static bool recurse = false;
+#define OBJECT_CHUNK_SIZE 64
+
+struct sel4utils_object_chunk {
+    sel4utils_object_chunk_t *next;
+    size_t count;
+    vka_object_t objects[OBJECT_CHUNK_SIZE];
+};
 
-    if (recurse) {
+/* set while this thread is in malloc for a chunk, to catch malloc allocating
+ * objects in the vspace that need another chunk */
+static __thread bool objects_in_malloc;
+
+static sel4utils_object_chunk_t *object_chunk_new(void)
+{
+    if (objects_in_malloc) {
         ZF_LOGF("VSPACE RECURSION ON MALLOC, YOU ARE DEAD\n");
     }
-    recurse = true;
+    objects_in_malloc = true;
+    sel4utils_object_chunk_t *chunk = malloc(sizeof(*chunk));
+    objects_in_malloc = false;
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->count = 0;
+    }
+    return chunk;
+}
 
-    sel4utils_process_t *process = cookie;
+/* make a chunk, already holding an object, the current one of a type */
+static void push_chunk(sel4utils_process_t *process, seL4_Word type, sel4utils_object_chunk_t *chunk)
+{
+    chunk->next = __atomic_load_n(&process->allocated_objects[type], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&process->allocated_objects[type], &chunk->next, chunk, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-    object_node_t *node = malloc(sizeof(object_node_t));
-    assert(node != NULL);
-    node->object = object;
+/* add an object to the current chunk of its type. Slots are claimed by incrementing
+ * the count, which may run past OBJECT_CHUNK_SIZE when the chunk is full. */
+static bool track_object(sel4utils_process_t *process, vka_object_t object)
+{
+    sel4utils_object_chunk_t *chunk = __atomic_load_n(&process->allocated_objects[object.type], __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        return false;
+    }
+    size_t slot = __atomic_fetch_add(&chunk->count, 1, __ATOMIC_RELAXED);
+    if (slot >= OBJECT_CHUNK_SIZE) {
+        return false;
+    }
+    chunk->objects[slot] = object;
+    return true;
+}
 
-    node->next = process->allocated_object_list_head;
-    process->allocated_object_list_head = node;
+void sel4utils_allocated_object(void *cookie, vka_object_t object)
+{
+    sel4utils_process_t *process = cookie;
+    assert(object.type < seL4_ObjectTypeCount);
+
+    if (track_object(process, object)) {
+        return;
+    }
+
+    /* Start a new chunk, preferably the spare. Nothing here waits on another thread, as a
+     * spinning higher priority spawner could starve a preempted lower priority one. */
+    sel4utils_object_chunk_t *chunk = __atomic_exchange_n(&process->spare_object_chunk, NULL, __ATOMIC_ACQUIRE);
+    bool refill = chunk != NULL;
+    if (chunk == NULL) {
+        /* another thread took the spare and has not replaced it yet, or the last refill
+         * failed, so give the object a chunk of its own */
+        chunk = object_chunk_new();
+        if (chunk == NULL) {
+            ZF_LOGE("Failed to allocate chunk to track object, it will be leaked");
+            return;
+        }
+    }
+    chunk->objects[0] = object;
+    chunk->count = 1;
+    push_chunk(process, object.type, chunk);
 
-    recurse = false;
+    if (refill) {
+        /* only the thread that took the spare replaces it, so it is still empty. If malloc
+         * causes more objects to be allocated they are tracked in the chunk just pushed. */
+        sel4utils_object_chunk_t *spare = object_chunk_new();
+        UNUSED sel4utils_object_chunk_t *old = __atomic_exchange_n(&process->spare_object_chunk, spare,
+                                                                    __ATOMIC_RELEASE);
+        assert(old == NULL);
+    }
 }
 
 static void clear_objects(sel4utils_process_t *process, vka_t *vka)
@@ -55,14 +121,18 @@ static void clear_objects(sel4utils_process_t *process, vka_t *vka)
     assert(process != NULL);
     assert(vka != NULL);
 
-    while (process->allocated_object_list_head != NULL) {
-        object_node_t *prev = process->allocated_object_list_head;
-
-        process->allocated_object_list_head = prev->next;
+    for (int type = 0; type < seL4_ObjectTypeCount; type++) {
+        while (process->allocated_objects[type] != NULL) {
+            sel4utils_object_chunk_t *chunk = process->allocated_objects[type];
+            process->allocated_objects[type] = chunk->next;
 
-        vka_free_object(vka, &prev->object);
-        free(prev);
+            vka_free_objects(vka, chunk->objects, MIN(chunk->count, OBJECT_CHUNK_SIZE));
+            free(chunk);
+        }
     }
+
+    free(process->spare_object_chunk);
+    process->spare_object_chunk = NULL;
 }
 
 static int next_free_slot(sel4utils_process_t *process, cspacepath_t *dest)
@@ -167,6 +237,86 @@ seL4_CPtr sel4utils_move_cap_to_process(sel4utils_process_t *process, cspacepath
     allocate_next_slot(process);
     return dest.capPtr;
 }
+
+/* reserve num contiguous slots, returning a path to the first one */
+static int next_free_slots(sel4utils_process_t *process, size_t num, cspacepath_t *dest)
+{
+    if (num == 0 || num > BIT(process->cspace_size) - process->cspace_next_free) {
+        ZF_LOGE("Can't allocate %zu slots, cspace is full.\n", num);
+        return -1;
+    }
+
+    return next_free_slot(process, dest);
+}
+
+/* delete the caps copied so far into a range that is then not allocated */
+static void clear_slots(cspacepath_t first, size_t num)
+{
+    for (size_t i = 0; i < num; i++) {
+        vka_cnode_delete(&first);
+        first.capPtr++;
+    }
+}
+
+seL4_CPtr sel4utils_copy_paths_to_process(sel4utils_process_t *process, const cspacepath_t *srcs, size_t num)
+{
+    cspacepath_t first = { 0 };
+    if (next_free_slots(process, num, &first) == -1) {
+        return 0;
+    }
+
+    cspacepath_t dest = first;
+    for (size_t i = 0; i < num; i++) {
+        int error = vka_cnode_copy(&dest, &srcs[i], seL4_AllRights);
+        if (error != seL4_NoError) {
+            ZF_LOGE("Failed to copy cap %zu of %zu\n", i, num);
+            clear_slots(first, i);
+            return 0;
+        }
+        dest.capPtr++;
+    }
+
+    process->cspace_next_free += num;
+    return first.capPtr;
+}
+
+seL4_CPtr sel4utils_copy_cap_range_to_process(sel4utils_process_t *process, vka_t *vka, seL4_CPtr first_cap,
+                                              size_t num)
+{
+    cspacepath_t first = { 0 };
+    if (next_free_slots(process, num, &first) == -1) {
+        return 0;
+    }
+
+    /* the caps are contiguous, so only the first path needs translating */
+    cspacepath_t src;
+    vka_cspace_make_path(vka, first_cap, &src);
+    cspacepath_t dest = first;
+    for (size_t i = 0; i < num; i++) {
+        int error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+        if (error != seL4_NoError) {
+            ZF_LOGE("Failed to copy cap %zu of %zu\n", i, num);
+            clear_slots(first, i);
+            return 0;
+        }
+        src.capPtr++;
+        dest.capPtr++;
+    }
+
+    process->cspace_next_free += num;
+    return first.capPtr;
+}
+
+seL4_CPtr sel4utils_move_cnode_to_process(sel4utils_process_t *process, cspacepath_t cnode, vka_t *from_vka)
+{
+    /* moving the cnode cap hands over every cap in it with a single invocation */
+    seL4_CPtr slot = sel4utils_move_cap_to_process(process, cnode, from_vka);
+    if (slot == 0) {
+        ZF_LOGE("Failed to move cnode\n");
+    }
+    return slot;
+}
+
 int sel4utils_stack_write(vspace_t *current_vspace, vspace_t *target_vspace,
                           vka_t *vka, void *buf, size_t len, uintptr_t *initial_stack_pointer)
 {
@@ -522,6 +672,12 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
 
     /* create a vspace */
     if (config.create_vspace) {
+        /* have a chunk ready before the vspace starts allocating objects */
+        process->spare_object_chunk = object_chunk_new();
+        if (process->spare_object_chunk == NULL) {
+            ZF_LOGE("Failed to allocate chunk to track objects");
+            goto error;
+        }
         sel4utils_get_vspace(spawner_vspace, &process->vspace, &process->data, vka, process->pd.cptr,
                              sel4utils_allocated_object, (void *) process);
 
@@ -669,6 +825,8 @@ error:
         free(process->elf_phdrs);
     }
 
+    free(process->spare_object_chunk);
+
     if (data != NULL) {
         free(data);
     }
@@ -4,18 +4,46 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
 #include <sel4utils/slab.h>
 #include <vka/capops.h>
 #include <vka/object.h>
 #include <utils/attribute.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Hashed set of the cookies of objects allocated from the delegate */
+typedef struct {
+    struct delegated_entry {
+        seL4_Word cookie;
+        bool used;
+    } *entries;
+    /* power of two, 0 until the first delegation */
+    size_t capacity;
+    /* word size minus log2 of the capacity, the hash is the top bits of the product */
+    unsigned int shift;
+    size_t count;
+} delegated_set_t;
 
 typedef struct {
-    /* number of objects in the slab */
-    seL4_CPtr n;
-    /* next free object in the slab */
-    seL4_CPtr next;
-    /* list of objects in the slab */
-    vka_object_t *objects;
+    /* size of the objects in the slab, only valid if enabled */
+    size_t size_bits;
+    /* whether objects of this type are allocated from the slab at all */
+    bool enabled;
+    /* number of objects the slab has created */
+    size_t n;
+    /* number of objects on the free stack */
+    size_t num_free;
+    /* free stack of objects, allocations are taken from the top */
+    seL4_CPtr *objects;
+    /* range of the cptrs of the objects the slab has created, only valid if n > 0 */
+    seL4_CPtr min_cptr;
+    seL4_CPtr max_cptr;
+    /* cookies of objects allocated from the delegate because the slab could not grow */
+    delegated_set_t delegated;
+    slab_stats_t stats;
 } slab_t;
 
 typedef struct {
@@ -60,6 +88,130 @@ static void delegate_cspace_free(void *data, seL4_CPtr slot)
     vka_cspace_free(sdata->delegate, slot);
 }
 
+/* Endpoints and notifications are handed out as copies, so that the slab keeps the
+ * object alive when the caller deletes their cap and can hand it out again once it
+ * is freed. Every other object is moved out of the slab and is gone once deleted */
+static bool slab_type_recycles(seL4_Word type)
+{
+    return type == seL4_EndpointObject || type == seL4_NotificationObject;
+}
+
+static int slab_grow(slab_data_t *sdata, slab_t *slab, seL4_Word type);
+
+#if CONFIG_WORD_SIZE == 64
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+#else
+#define HASH_MULTIPLIER 0x9E3779B9ul
+#endif
+
+static size_t delegated_hash(delegated_set_t *set, seL4_Word cookie)
+{
+    /* Fibonacci hashing on the top bits of the product, so cookies that share their
+     * low bits still spread evenly */
+    return (size_t)((cookie * (seL4_Word)HASH_MULTIPLIER) >> set->shift);
+}
+
+/* Find the entry for a cookie, or the empty entry that ends its probe sequence */
+static struct delegated_entry *delegated_find(delegated_set_t *set, seL4_Word cookie)
+{
+    size_t i = delegated_hash(set, cookie);
+    while (set->entries[i].used && set->entries[i].cookie != cookie) {
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return &set->entries[i];
+}
+
+/* Make room for one more cookie, keeping the set at most half full */
+static int delegated_reserve(delegated_set_t *set)
+{
+    if ((set->count + 1) * 2 <= set->capacity) {
+        return 0;
+    }
+    delegated_set_t grown = {
+        .capacity = set->capacity ? set->capacity * 2 : 16,
+        .shift = set->capacity ? set->shift - 1 : seL4_WordBits - 4,
+        .count = set->count,
+    };
+    grown.entries = calloc(grown.capacity, sizeof(*grown.entries));
+    if (grown.entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->entries[i].used) {
+            *delegated_find(&grown, set->entries[i].cookie) = set->entries[i];
+        }
+    }
+    free(set->entries);
+    *set = grown;
+    return 0;
+}
+
+/* @return true if the cookie was in the set, in which case it is removed */
+static bool delegated_remove(delegated_set_t *set, seL4_Word cookie)
+{
+    if (set->count == 0) {
+        return false;
+    }
+    struct delegated_entry *e = delegated_find(set, cookie);
+    if (!e->used) {
+        return false;
+    }
+
+    /* shift back any following entries that would no longer be reachable from their
+     * hash over the hole this leaves */
+    size_t mask = set->capacity - 1;
+    size_t i = e - set->entries;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (!set->entries[j].used) {
+            break;
+        }
+        size_t k = delegated_hash(set, set->entries[j].cookie);
+        /* entry j can fill the hole at i if its home k is not cyclically in (i, j] */
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            set->entries[i] = set->entries[j];
+            i = j;
+        }
+    }
+    set->entries[i].used = false;
+    set->count--;
+    return true;
+}
+
+/* Allocate from the delegate when the slab is empty and cannot grow. The cookie is
+ * remembered so that freeing the object goes back to the delegate */
+static int slab_delegate_alloc(slab_data_t *sdata, slab_t *slab, const cspacepath_t *dest, seL4_Word type,
+                               seL4_Word size_bits, seL4_Word *res)
+{
+    if (delegated_reserve(&slab->delegated) != 0) {
+        ZF_LOGE("Failed to track delegated allocation of type %lu", (long) type);
+        return -1;
+    }
+
+    int error = vka_utspace_alloc(sdata->delegate, dest, type, size_bits, res);
+    if (error == 0) {
+        struct delegated_entry *e = delegated_find(&slab->delegated, *res);
+        assert(!e->used);
+        e->cookie = *res;
+        e->used = true;
+        slab->delegated.count++;
+        slab->stats.delegated++;
+    }
+    return error;
+}
+
+/* @return true if target is the cookie of an object handed out by the slab itself */
+static bool slab_owns(slab_t *slab, seL4_Word type, seL4_Word target)
+{
+    if (!slab_type_recycles(type)) {
+        /* objects moved out of the slab are handed out without a cookie. A delegated
+         * object whose cookie is also 0 is leaked rather than freed while it may be in use */
+        return target == 0;
+    }
+    return slab->n > 0 && target >= slab->min_cptr && target <= slab->max_cptr;
+}
+
 static int slab_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type,
         seL4_Word size_bits, seL4_Word *res)
 {
@@ -70,19 +222,42 @@ static int slab_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word ty
     }
 
     slab_t *slab = &sdata->slabs[type];
-    if (slab->next == slab->n) {
-        ZF_LOGW("Slab of type %lu expired, using delegate allocator", type);
+    if (!slab->enabled || vka_get_object_size(type, size_bits) != slab->size_bits) {
         return vka_utspace_alloc(sdata->delegate, dest, type, size_bits, res);
     }
 
+    if (slab->num_free == 0) {
+        slab->stats.misses++;
+        /* a partial grow still leaves objects to hand out */
+        if (slab_grow(sdata, slab, type) != 0 && slab->num_free == 0) {
+            ZF_LOGW("Failed to grow slab of type %lu, using delegate allocator", (long) type);
+            return slab_delegate_alloc(sdata, slab, dest, type, size_bits, res);
+        }
+    } else {
+        slab->stats.hits++;
+    }
+
+    seL4_CPtr object = slab->objects[slab->num_free - 1];
     cspacepath_t src;
-    vka_cspace_make_path(sdata->delegate, slab->objects[slab->next].cptr, &src);
-    if (vka_cnode_move(dest, &src) != seL4_NoError) {
+    vka_cspace_make_path(sdata->delegate, object, &src);
+    int error;
+    if (slab_type_recycles(type)) {
+        error = vka_cnode_copy(dest, &src, seL4_AllRights);
+    } else {
+        error = vka_cnode_move(dest, &src);
+    }
+    if (error != seL4_NoError) {
         ZF_LOGW("Dest invalid\n");
         return -1;
     }
 
-    slab->next++;
+    slab->num_free--;
+    if (slab_type_recycles(type)) {
+        *res = object;
+    } else {
+        vka_cspace_free(sdata->delegate, object);
+        *res = 0;
+    }
     return 0;
 }
 
@@ -99,11 +274,50 @@ static int delegate_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_
     return vka_utspace_alloc_at(sdata->delegate, dest, type, size_bits, paddr, res);
 }
 
-static void
-slab_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
+static void slab_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
 {
-    //TODO this should be possible - swap the object in at next, but do we need it?
-    ZF_LOGW("slab_utspace_free not implemented");
+    slab_data_t *sdata = data;
+
+    if (type >= seL4_ObjectTypeCount) {
+        return;
+    }
+
+    slab_t *slab = &sdata->slabs[type];
+    if (!slab->enabled || vka_get_object_size(type, size_bits) != slab->size_bits) {
+        vka_utspace_free(sdata->delegate, type, size_bits, target);
+        return;
+    }
+
+    /* the slab's own objects are checked first, so that a delegate cookie that happens
+     * to match one of them cannot send a slab object back to the delegate */
+    if (!slab_owns(slab, type, target)) {
+        if (delegated_remove(&slab->delegated, target)) {
+            vka_utspace_free(sdata->delegate, type, size_bits, target);
+        } else if (slab_type_recycles(type)) {
+            ZF_LOGE("Object %lu of type %lu was not allocated by this slab", (long) target, (long) type);
+        }
+        return;
+    }
+
+    slab->stats.frees++;
+    if (!slab_type_recycles(type)) {
+        /* the caller deleted the only cap, the memory stays with the slab's untyped */
+        return;
+    }
+
+    /* remove any caps still derived from the object and clear a pending signal
+     * so that the next user starts from a clean object */
+    cspacepath_t path;
+    vka_cspace_make_path(sdata->delegate, target, &path);
+    vka_cnode_revoke(&path);
+    if (type == seL4_NotificationObject) {
+        seL4_Word badge;
+        seL4_Poll(target, &badge);
+    }
+    assert(slab->num_free < slab->n);
+    slab->objects[slab->num_free] = target;
+    slab->num_free++;
+    slab->stats.recycled++;
 }
 
 static size_t calculate_total_size(size_t object_freq[seL4_ObjectTypeCount]) {
@@ -147,30 +361,79 @@ static seL4_Error alloc_object(vka_t *delegate, vka_object_t *untyped, size_t si
                                         path.destDepth, path.offset, 1);
 }
 
+/* Creates n objects from the untyped and pushes them onto the free stack, such that
+ * they are handed out in the order they were created */
+static int fill_slab(vka_t *delegate, vka_object_t *untyped, slab_t *slab, size_t n, seL4_Word type)
+{
+    seL4_CPtr *objects = realloc(slab->objects, (slab->n + n) * sizeof(seL4_CPtr));
+    if (objects == NULL) {
+        ZF_LOGE("Failed to allocate %zu objects of %zu size bits, %lu type", n, slab->size_bits, (long) type);
+        return -1;
+    }
+    slab->objects = objects;
+
+    seL4_CPtr *top = &slab->objects[slab->num_free];
+    size_t created;
+    for (created = 0; created < n; created++) {
+        vka_object_t object;
+        if (alloc_object(delegate, untyped, slab->size_bits, type, &object) != seL4_NoError) {
+            break;
+        }
+        top[n - 1 - created] = object.cptr;
+        if (slab->n + created == 0) {
+            slab->min_cptr = slab->max_cptr = object.cptr;
+        } else {
+            slab->min_cptr = MIN(slab->min_cptr, object.cptr);
+            slab->max_cptr = MAX(slab->max_cptr, object.cptr);
+        }
+    }
+    if (created < n) {
+        /* keep whatever was created before the failure */
+        memmove(top, &top[n - created], created * sizeof(seL4_CPtr));
+    }
+    slab->num_free += created;
+    slab->n += created;
+    return created == n ? 0 : -1;
+}
+
 static int alloc_object_slab(vka_t *delegate, vka_object_t *untyped, slab_t *slab, size_t n,
                              size_t size_bits, seL4_Word type)
 {
     ZF_LOGI("Preallocating %zu objects of %zu size bits, %lu type\n", n, size_bits, (long) type);
 
-    slab->n = n;
-    slab->next = 0;
+    slab->size_bits = size_bits;
+    slab->enabled = n > 0;
 
-    if (n > 0) {
-        slab->objects = calloc(n, sizeof(vka_object_t));
-        if (slab->objects == NULL) {
-            ZF_LOGI("Failed to allocate %zu objects of %zu size bits, %lu type", n, size_bits, (long) type);
-            return -1;
-        }
+    if (n == 0) {
+        return 0;
     }
 
-    for (int i = 0; i < slab->n; i++) {
-        if (alloc_object(delegate, untyped, size_bits, type, &slab->objects[i]) != seL4_NoError) {
-            return -1;
-        }
+    /* success */
+    return fill_slab(delegate, untyped, slab, n, type);
+}
+
+static int slab_grow(slab_data_t *sdata, slab_t *slab, seL4_Word type)
+{
+    size_t n = CONFIG_SEL4UTILS_SLAB_GROW_BATCH;
+    if (n == 0) {
+        return -1;
     }
 
-    /* success */
-    return 0;
+    vka_object_t untyped;
+    size_t total_size = BIT(slab->size_bits) * n;
+    size_t total_size_bits = seL4_WordBits - CLZL(total_size - 1);
+    int error = vka_alloc_untyped(sdata->delegate, total_size_bits, &untyped);
+    if (error != 0) {
+        ZF_LOGE("Failed to allocate untyped of size bits %zu\n", total_size_bits);
+        return -1;
+    }
+    ZF_LOGI("Growing slab by %zu objects of %zu size bits, %lu type\n", n, slab->size_bits, (long) type);
+    /* the untyped is never freed, its memory backs the slab from now on */
+    error = fill_slab(sdata->delegate, &untyped, slab, n, type);
+    if (error == 0) {
+        slab->stats.grown++;
+    }
+    return error;
 }
 
 int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount]) {
@@ -233,3 +496,29 @@ int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTy
 
     return 0;
 }
+
+int slab_get_stats(vka_t *slab_vka, seL4_Word type, slab_stats_t *stats)
+{
+    slab_data_t *sdata = slab_vka->data;
+    if (type >= seL4_ObjectTypeCount || stats == NULL) {
+        return -1;
+    }
+    *stats = sdata->slabs[type].stats;
+    stats->available = sdata->slabs[type].num_free;
+    return 0;
+}
+
+void slab_print_stats(vka_t *slab_vka)
+{
+    slab_data_t *sdata = slab_vka->data;
+    for (int i = 0; i < seL4_ObjectTypeCount; i++) {
+        slab_t *slab = &sdata->slabs[i];
+        if (!slab->enabled) {
+            continue;
+        }
+        printf("slab type %d: %zu objects, %zu free, %zu hits, %zu misses, %zu frees, %zu recycled, grown %zu times, "
+               "%zu delegated\n",
+               i, slab->n, slab->num_free, slab->stats.hits, slab->stats.misses, slab->stats.frees,
+               slab->stats.recycled, slab->stats.grown, slab->stats.delegated);
+    }
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <sel4utils/thread.h>
+#include <sel4utils/thread_pool.h>
+#include <utils/util.h>
+
+struct sel4utils_pool_thread {
+    /* must be first, users are handed a pointer to it */
+    sel4utils_thread_t thread;
+    /* core the thread is scheduled on */
+    int core;
+    /* next idle thread of the same core */
+    struct sel4utils_pool_thread *next;
+};
+
+static sel4utils_pool_thread_t *pool_thread_create(sel4utils_thread_pool_t *pool, int core)
+{
+    sel4utils_pool_thread_t *pt = calloc(1, sizeof(*pt));
+    if (pt == NULL) {
+        ZF_LOGE("Failed to allocate pool thread");
+        return NULL;
+    }
+
+    sel4utils_thread_config_t config = pool->config;
+    config.sched_params = pool->core_params[core];
+    int error = sel4utils_configure_thread_config(pool->vka, pool->parent, pool->alloc, config, &pt->thread);
+    if (error) {
+        ZF_LOGE("Failed to configure pool thread");
+        free(pt);
+        return NULL;
+    }
+
+    /* on the MCS kernel the core is determined by the sched control the sc was configured with */
+    if (!config_set(CONFIG_KERNEL_MCS) && pool->num_cores > 1) {
+        error = sel4utils_set_sched_affinity(&pt->thread, config.sched_params);
+        if (error) {
+            ZF_LOGE("Failed to set affinity of pool thread to core %d", core);
+            sel4utils_clean_up_thread(pool->vka, pool->alloc, &pt->thread);
+            free(pt);
+            return NULL;
+        }
+    }
+    pt->core = core;
+    return pt;
+}
+
+static void pool_thread_destroy(sel4utils_thread_pool_t *pool, sel4utils_pool_thread_t *pt)
+{
+    sel4utils_clean_up_thread(pool->vka, pool->alloc, &pt->thread);
+    free(pt);
+}
+
+int sel4utils_thread_pool_init(sel4utils_thread_pool_t *pool, vka_t *vka, vspace_t *parent, vspace_t *alloc,
+                               simple_t *simple, sel4utils_thread_config_t config, size_t num_warm, size_t max_idle)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->vka = vka;
+    pool->parent = parent;
+    pool->alloc = alloc;
+    pool->config = config;
+    pool->max_idle = max_idle;
+    pool->num_cores = 1;
+    if (simple != NULL) {
+        pool->num_cores = MAX(MIN(simple_get_core_count(simple), CONFIG_MAX_NUM_NODES), 1);
+    }
+
+    for (int core = 0; core < pool->num_cores; core++) {
+        sched_params_t params = config.sched_params;
+        params.core = core;
+        if (config_set(CONFIG_KERNEL_MCS) && simple != NULL && params.create_sc) {
+            params.sched_ctrl = simple_get_sched_ctrl(simple, core);
+        }
+        pool->core_params[core] = params;
+    }
+
+    for (int core = 0; core < pool->num_cores; core++) {
+        for (size_t i = 0; i < num_warm; i++) {
+            sel4utils_pool_thread_t *pt = pool_thread_create(pool, core);
+            if (pt == NULL) {
+                sel4utils_thread_pool_destroy(pool);
+                return -1;
+            }
+            pt->next = pool->idle[core];
+            pool->idle[core] = pt;
+            pool->num_idle[core]++;
+        }
+    }
+
+    return 0;
+}
+
+sel4utils_thread_t *sel4utils_thread_pool_get(sel4utils_thread_pool_t *pool, int core)
+{
+    if (core < 0 || core >= pool->num_cores) {
+        ZF_LOGE("Invalid core %d", core);
+        return NULL;
+    }
+
+    sel4utils_pool_thread_t *pt = pool->idle[core];
+    if (pt != NULL) {
+        pool->idle[core] = pt->next;
+        pool->num_idle[core]--;
+        pt->next = NULL;
+    } else {
+        pt = pool_thread_create(pool, core);
+        if (pt == NULL) {
+            return NULL;
+        }
+    }
+    return &pt->thread;
+}
+
+void sel4utils_thread_pool_put(sel4utils_thread_pool_t *pool, sel4utils_thread_t *thread)
+{
+    sel4utils_pool_thread_t *pt = (sel4utils_pool_thread_t *) thread;
+
+    if (pool->num_idle[pt->core] >= pool->max_idle) {
+        pool_thread_destroy(pool, pt);
+        return;
+    }
+
+    int error = seL4_TCB_Suspend(thread->tcb.cptr);
+    if (error) {
+        ZF_LOGE("Failed to suspend pool thread, destroying it");
+        pool_thread_destroy(pool, pt);
+        return;
+    }
+
+    /* drop any state left by the last user, the next start writes a fresh context anyway */
+    seL4_UserContext context = {0};
+    error = seL4_TCB_WriteRegisters(thread->tcb.cptr, false, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word),
+                                    &context);
+    if (error) {
+        ZF_LOGE("Failed to reset registers of pool thread, destroying it");
+        pool_thread_destroy(pool, pt);
+        return;
+    }
+    /* ignore the error, the thread most likely had no bound notification */
+    seL4_TCB_UnbindNotification(thread->tcb.cptr);
+
+    pt->next = pool->idle[pt->core];
+    pool->idle[pt->core] = pt;
+    pool->num_idle[pt->core]++;
+}
+
+int sel4utils_thread_pool_set_affinity(sel4utils_thread_pool_t *pool, sel4utils_thread_t *thread, int core)
+{
+    sel4utils_pool_thread_t *pt = (sel4utils_pool_thread_t *) thread;
+
+    if (core < 0 || core >= pool->num_cores) {
+        ZF_LOGE("Invalid core %d", core);
+        return -1;
+    }
+    if (core == pt->core) {
+        return 0;
+    }
+
+    int error = sel4utils_set_sched_affinity(thread, pool->core_params[core]);
+    if (error) {
+        ZF_LOGE("Failed to move pool thread to core %d", core);
+        return error;
+    }
+    pt->core = core;
+    return 0;
+}
+
+void sel4utils_thread_pool_destroy(sel4utils_thread_pool_t *pool)
+{
+    for (int core = 0; core < pool->num_cores; core++) {
+        while (pool->idle[core] != NULL) {
+            sel4utils_pool_thread_t *pt = pool->idle[core];
+            pool->idle[core] = pt->next;
+            pool_thread_destroy(pool, pt);
+        }
+        pool->num_idle[core] = 0;
+    }
+}
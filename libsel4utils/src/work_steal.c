@@ -0,0 +1,471 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/object.h>
+#include <sel4utils/thread.h>
+#include <sel4utils/work_steal.h>
+#include <utils/util.h>
+
+#define DEQUE_SIZE BIT(CONFIG_SEL4UTILS_WORK_STEAL_DEQUE_BITS)
+#define DEQUE_MASK MASK(CONFIG_SEL4UTILS_WORK_STEAL_DEQUE_BITS)
+/* rounds of stealing attempts before a worker parks */
+#define STEAL_ROUNDS 4
+
+typedef struct ws_task {
+    sel4utils_ws_fn_t fn;
+    void *arg;
+    sel4utils_ws_group_t *group;
+} ws_task_t;
+
+/* Chase-Lev deque with a fixed size buffer. The owner pushes and takes at the bottom,
+ * thieves steal from the top. A thief may read a slot that the owner is overwriting,
+ * but only after the top has moved past it, in which case its CAS on the top fails and
+ * the torn task is discarded */
+typedef struct ws_deque {
+    long top;
+    long bottom;
+    ws_task_t tasks[DEQUE_SIZE];
+} ws_deque_t;
+
+typedef struct ws_worker {
+    sel4utils_ws_t *ws;
+    int id;
+    sel4utils_thread_t thread;
+    vka_object_t ntfn;
+    /* set while the worker waits on its notification */
+    int parked;
+    bool started;
+    bool exited;
+    /* state of the victim selection */
+    unsigned int seed;
+    ws_deque_t deque;
+} ws_worker_t;
+
+struct sel4utils_ws {
+    vka_t *vka;
+    vspace_t *vspace;
+    int num_workers;
+    ws_worker_t **workers;
+    int num_parked;
+    bool stopping;
+    /* set while a thread outside the scheduler is in sel4utils_ws_run */
+    bool running;
+    /* task submitted from outside the scheduler, waiting for a worker to take it */
+    ws_task_t *root;
+    /* signalled when the root task completes */
+    vka_object_t done;
+};
+
+static __thread ws_worker_t *current_worker;
+
+static bool deque_push(ws_deque_t *deque, ws_task_t task)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (b - t >= (long) DEQUE_SIZE) {
+        return false;
+    }
+    deque->tasks[b & DEQUE_MASK] = task;
+    /* publish the task before thieves can see the new bottom */
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool deque_take(ws_deque_t *deque, ws_task_t *task)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        /* empty */
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *task = deque->tasks[b & DEQUE_MASK];
+    if (t == b) {
+        /* last task, race against thieves for it */
+        bool won = __atomic_compare_exchange_n(&deque->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+    return true;
+}
+
+static bool deque_steal(ws_deque_t *deque, ws_task_t *task)
+{
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+        return false;
+    }
+    *task = deque->tasks[t & DEQUE_MASK];
+    return __atomic_compare_exchange_n(&deque->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static bool deque_empty(ws_deque_t *deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void wake_one(sel4utils_ws_t *ws)
+{
+    /* order the caller's publication of new work before the load of num_parked. Paired
+     * with the fence in park, either the parking worker sees the work or we see it parked */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ws->num_parked, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    for (int i = 0; i < ws->num_workers; i++) {
+        ws_worker_t *worker = ws->workers[i];
+        int parked = 1;
+        if (__atomic_compare_exchange_n(&worker->parked, &parked, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            __atomic_fetch_sub(&ws->num_parked, 1, __ATOMIC_SEQ_CST);
+            seL4_Signal(worker->ntfn.cptr);
+            return;
+        }
+    }
+}
+
+static void run_task(ws_task_t *task)
+{
+    task->fn(task->arg);
+    if (task->group) {
+        __atomic_fetch_sub(&task->group->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static bool try_steal(ws_worker_t *self, ws_task_t *task)
+{
+    sel4utils_ws_t *ws = self->ws;
+    /* xorshift to pick where to start looking */
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 17;
+    self->seed ^= self->seed << 5;
+    int start = self->seed % ws->num_workers;
+    for (int i = 0; i < ws->num_workers; i++) {
+        ws_worker_t *victim = ws->workers[(start + i) % ws->num_workers];
+        if (victim != self && deque_steal(&victim->deque, task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool find_task(ws_worker_t *self, ws_task_t *task)
+{
+    return deque_take(&self->deque, task) || try_steal(self, task);
+}
+
+static bool has_work(sel4utils_ws_t *ws)
+{
+    if (__atomic_load_n(&ws->root, __ATOMIC_ACQUIRE) != NULL || __atomic_load_n(&ws->stopping, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    for (int i = 0; i < ws->num_workers; i++) {
+        if (!deque_empty(&ws->workers[i]->deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void park(ws_worker_t *self)
+{
+    sel4utils_ws_t *ws = self->ws;
+    __atomic_store_n(&self->parked, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&ws->num_parked, 1, __ATOMIC_SEQ_CST);
+    /* pairs with the fence in wake_one */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (has_work(ws)) {
+        int parked = 1;
+        if (__atomic_compare_exchange_n(&self->parked, &parked, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            __atomic_fetch_sub(&ws->num_parked, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+        /* somebody already woke us, consume their signal below */
+    }
+    seL4_Wait(self->ntfn.cptr, NULL);
+}
+
+static void worker_main(void *arg0, void *arg1, void *ipc_buf)
+{
+    ws_worker_t *self = arg0;
+    sel4utils_ws_t *ws = self->ws;
+    current_worker = self;
+
+    while (!__atomic_load_n(&ws->stopping, __ATOMIC_ACQUIRE)) {
+        ws_task_t task;
+        bool found = false;
+        for (int i = 0; i < STEAL_ROUNDS && !found; i++) {
+            found = find_task(self, &task);
+        }
+        if (!found) {
+            ws_task_t *root = __atomic_exchange_n(&ws->root, NULL, __ATOMIC_ACQ_REL);
+            if (root != NULL) {
+                root->fn(root->arg);
+                seL4_Signal(ws->done.cptr);
+                continue;
+            }
+            park(self);
+            continue;
+        }
+        run_task(&task);
+    }
+
+    __atomic_store_n(&self->exited, true, __ATOMIC_RELEASE);
+    seL4_TCB_Suspend(self->thread.tcb.cptr);
+}
+
+int sel4utils_ws_worker_id(void)
+{
+    return current_worker ? current_worker->id : -1;
+}
+
+void sel4utils_ws_spawn(sel4utils_ws_group_t *group, sel4utils_ws_fn_t fn, void *arg)
+{
+    ws_worker_t *self = current_worker;
+    assert(self != NULL);
+    ws_task_t task = {
+        .fn = fn,
+        .arg = arg,
+        .group = group,
+    };
+    __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+    if (!deque_push(&self->deque, task)) {
+        /* deque is full, there is already plenty of parallelism */
+        run_task(&task);
+        return;
+    }
+    wake_one(self->ws);
+}
+
+void sel4utils_ws_sync(sel4utils_ws_group_t *group)
+{
+    ws_worker_t *self = current_worker;
+    assert(self != NULL);
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        ws_task_t task;
+        if (find_task(self, &task)) {
+            run_task(&task);
+        } else {
+            seL4_Yield();
+        }
+    }
+}
+
+int sel4utils_ws_run(sel4utils_ws_t *ws, sel4utils_ws_fn_t fn, void *arg)
+{
+    if (current_worker != NULL) {
+        fn(arg);
+        return 0;
+    }
+
+    ws_task_t root = {
+        .fn = fn,
+        .arg = arg,
+    };
+    /* the done notification is shared, so a second caller could consume our signal.
+     * Only one run may be in progress until its root has completed */
+    bool expected = false;
+    if (!__atomic_compare_exchange_n(&ws->running, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        ZF_LOGE("Another task is already running on the scheduler");
+        return -1;
+    }
+    __atomic_store_n(&ws->root, &root, __ATOMIC_RELEASE);
+    /* the root is only looked at by workers that are out of work, make sure one is awake */
+    wake_one(ws);
+    seL4_Wait(ws->done.cptr, NULL);
+    __atomic_store_n(&ws->running, false, __ATOMIC_RELEASE);
+    return 0;
+}
+
+typedef struct pfor {
+    sel4utils_ws_range_fn_t fn;
+    void *arg;
+    size_t grain;
+} pfor_t;
+
+typedef struct pfor_range {
+    pfor_t *pfor;
+    size_t begin;
+    size_t end;
+} pfor_range_t;
+
+static void pfor_task(void *arg)
+{
+    pfor_range_t *range = arg;
+    pfor_t *pfor = range->pfor;
+    size_t begin = range->begin;
+    size_t end = range->end;
+    /* hand the upper halves to thieves and keep splitting the lower half */
+    sel4utils_ws_group_t group = SEL4UTILS_WS_GROUP_INIT;
+    pfor_range_t halves[sizeof(size_t) * 8];
+    int n = 0;
+    while (end - begin > pfor->grain) {
+        size_t mid = begin + (end - begin) / 2;
+        halves[n] = (pfor_range_t) {
+            .pfor = pfor, .begin = mid, .end = end
+        };
+        sel4utils_ws_spawn(&group, pfor_task, &halves[n]);
+        n++;
+        end = mid;
+    }
+    pfor->fn(pfor->arg, begin, end);
+    sel4utils_ws_sync(&group);
+}
+
+int sel4utils_ws_parallel_for(sel4utils_ws_t *ws, size_t begin, size_t end, size_t grain,
+                              sel4utils_ws_range_fn_t fn, void *arg)
+{
+    if (end <= begin) {
+        return 0;
+    }
+    pfor_t pfor = {
+        .fn = fn,
+        .arg = arg,
+        .grain = MAX(grain, (size_t) 1),
+    };
+    pfor_range_t range = {
+        .pfor = &pfor,
+        .begin = begin,
+        .end = end,
+    };
+    return sel4utils_ws_run(ws, pfor_task, &range);
+}
+
+static void worker_destroy(sel4utils_ws_t *ws, ws_worker_t *worker)
+{
+    if (worker->thread.tcb.cptr != 0) {
+        sel4utils_clean_up_thread(ws->vka, ws->vspace, &worker->thread);
+    }
+    if (worker->ntfn.cptr != 0) {
+        vka_free_object(ws->vka, &worker->ntfn);
+    }
+    free(worker);
+}
+
+static ws_worker_t *worker_create(sel4utils_ws_t *ws, int id, sel4utils_thread_config_t config,
+                                  sched_params_t params, bool set_affinity)
+{
+    ws_worker_t *worker = calloc(1, sizeof(*worker));
+    if (worker == NULL) {
+        ZF_LOGE("Failed to allocate worker");
+        return NULL;
+    }
+    worker->ws = ws;
+    worker->id = id;
+    worker->seed = id * 2654435761u + 1;
+
+    if (vka_alloc_notification(ws->vka, &worker->ntfn) != 0) {
+        ZF_LOGE("Failed to allocate notification for worker %d", id);
+        worker_destroy(ws, worker);
+        return NULL;
+    }
+
+    config.sched_params = params;
+    if (sel4utils_configure_thread_config(ws->vka, ws->vspace, ws->vspace, config, &worker->thread) != 0) {
+        ZF_LOGE("Failed to configure worker %d", id);
+        worker_destroy(ws, worker);
+        return NULL;
+    }
+
+    if (set_affinity && sel4utils_set_sched_affinity(&worker->thread, params) != 0) {
+        ZF_LOGE("Failed to set affinity of worker %d to core %d", id, (int) params.core);
+        worker_destroy(ws, worker);
+        return NULL;
+    }
+    NAME_THREAD(worker->thread.tcb.cptr, "ws worker");
+    return worker;
+}
+
+sel4utils_ws_t *sel4utils_ws_new(vka_t *vka, vspace_t *vspace, simple_t *simple, sel4utils_thread_config_t config,
+                                 int num_workers)
+{
+    int num_cores = 1;
+    if (simple != NULL) {
+        num_cores = MAX(simple_get_core_count(simple), 1);
+    }
+    if (num_workers <= 0) {
+        num_workers = num_cores;
+    }
+
+    sel4utils_ws_t *ws = calloc(1, sizeof(*ws));
+    if (ws == NULL) {
+        ZF_LOGE("Failed to allocate scheduler");
+        return NULL;
+    }
+    ws->vka = vka;
+    ws->vspace = vspace;
+    ws->workers = calloc(num_workers, sizeof(ws_worker_t *));
+    if (ws->workers == NULL || vka_alloc_notification(vka, &ws->done) != 0) {
+        ZF_LOGE("Failed to allocate scheduler");
+        sel4utils_ws_destroy(ws);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        int core = i % num_cores;
+        sched_params_t params = config.sched_params;
+        params.core = core;
+        if (config_set(CONFIG_KERNEL_MCS) && simple != NULL && params.create_sc) {
+            params.sched_ctrl = simple_get_sched_ctrl(simple, core);
+        }
+        /* on the MCS kernel the core is determined by the sched control the sc was configured with */
+        bool set_affinity = !config_set(CONFIG_KERNEL_MCS) && num_cores > 1;
+        ws->workers[i] = worker_create(ws, i, config, params, set_affinity);
+        if (ws->workers[i] == NULL) {
+            sel4utils_ws_destroy(ws);
+            return NULL;
+        }
+        ws->num_workers++;
+    }
+
+    /* only start the workers once they can all see each other */
+    for (int i = 0; i < ws->num_workers; i++) {
+        if (sel4utils_start_thread(&ws->workers[i]->thread, worker_main, ws->workers[i], NULL, 1) != 0) {
+            ZF_LOGE("Failed to start worker %d", i);
+            sel4utils_ws_destroy(ws);
+            return NULL;
+        }
+        ws->workers[i]->started = true;
+    }
+
+    return ws;
+}
+
+void sel4utils_ws_destroy(sel4utils_ws_t *ws)
+{
+    __atomic_store_n(&ws->stopping, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < ws->num_workers; i++) {
+        seL4_Signal(ws->workers[i]->ntfn.cptr);
+    }
+    /* wait for every started worker to leave its loop before deleting any of them, as
+     * workers look at each other's deques until they exit */
+    for (int i = 0; i < ws->num_workers; i++) {
+        ws_worker_t *worker = ws->workers[i];
+        while (worker->started && !__atomic_load_n(&worker->exited, __ATOMIC_ACQUIRE)) {
+            seL4_Yield();
+        }
+    }
+    for (int i = 0; i < ws->num_workers; i++) {
+        worker_destroy(ws, ws->workers[i]);
+    }
+    if (ws->done.cptr != 0) {
+        vka_free_object(ws->vka, &ws->done);
+    }
+    free(ws->workers);
+    free(ws);
+}
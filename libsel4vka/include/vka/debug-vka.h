@@ -22,3 +22,11 @@
  */
 int vka_init_debugvka(vka_t *vka, vka_t *tracee);
 
+/* Print the number of slots and objects allocated through a debug allocator
+ * that are still live. If CONFIG_LIB_SEL4_VKA_DEBUG_CALL_SITES is set, they
+ * are also grouped by the return address of the allocation call that made
+ * them, which points at the caller of the vka allocation function.
+ *
+ * vka - An allocator initialised by vka_init_debugvka.
+ */
+void vka_debugvka_report_leaks(vka_t *vka);
@@ -116,6 +116,30 @@ static inline void vka_free_object(vka_t *vka, vka_object_t *object)
     vka_utspace_free(vka, object->type, object->size_bits, object->ut);
 }
 
+/* Free a batch of objects. All of their caps are deleted before any slot or
+ * untyped memory is returned, so the allocator sees the whole batch released
+ * together rather than interleaved with deletions. */
+static inline void vka_free_objects(vka_t *vka, vka_object_t *objects, size_t num)
+{
+    for (size_t i = 0; i < num; i++) {
+        cspacepath_t path;
+        vka_cspace_make_path(vka, objects[i].cptr, &path);
+        if (path.capPtr == 0) {
+            ZF_LOGE("Failed to create cspace path to object");
+            continue;
+        }
+        /* ignore any errors */
+        seL4_CNode_Delete(path.root, path.capPtr, path.capDepth);
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        if (objects[i].cptr != 0) {
+            vka_cspace_free(vka, objects[i].cptr);
+            vka_utspace_free(vka, objects[i].type, objects[i].size_bits, objects[i].ut);
+        }
+    }
+}
+
 static inline uintptr_t vka_object_paddr(vka_t *vka, vka_object_t *object)
 {
     return vka_utspace_paddr(vka, object->ut, object->type, object->size_bits);
@@ -14,18 +14,46 @@
 #include <stdlib.h>
 #include <vka/cspacepath_t.h>
 #include <vka/vka.h>
+#include <vka/debug-vka.h>
 
 #ifndef CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_SLOTS_SZ
 #define CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_SLOTS_SZ 0
 #endif
 #ifndef CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_OBJS_SZ
-#define CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_SLOTS_SZ 0
+#define CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_OBJS_SZ 0
 #endif
 
 /* Kconfig-set sizes for buffers to track live slots and objects. */
 static size_t live_slots_sz = CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_SLOTS_SZ;
 static size_t live_objs_sz = CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_OBJS_SZ;
 
+/* An entry in a table of live resources. Entries with a 0 key are empty. */
+struct entry {
+    /* The slot or the cookie of the object. */
+    seL4_Word key;
+    /* Used for confirming that a caller is freeing an object in the same way
+     * they allocated it. Unused for slots.
+     */
+    seL4_Word type;
+    seL4_Word size_bits;
+    /* Return address of the allocation, if call sites are recorded. */
+    void *site;
+};
+
+/* Open addressing hash table with linear probing. The capacity is a power of
+ * two at least twice the maximum number of live entries, so probe sequences
+ * stay short.
+ */
+typedef struct {
+    struct entry *entries;
+    size_t capacity;
+    /* Word size minus log2 of the capacity, selects the top bits of a hash. */
+    unsigned int shift;
+    /* Maximum number of live entries. 0 if tracking is disabled. */
+    size_t max;
+    size_t count;
+} table_t;
+
 typedef struct {
 
     /* The underlying allocator that we call to effect allocations. This is
@@ -34,27 +62,86 @@ typedef struct {
      */
     vka_t *underlying;
 
-    /* Metadata related to currently live CSlots. The live_slots list contains
-     * non-null entries representing currently live CSlots. Note that these may
-     * be interspersed with null (dead) entries.
-     */
-    seL4_CPtr *live_slots;
-    size_t live_slots_sz;
+    /* Currently live CSlots, keyed by slot. */
+    table_t live_slots;
 
-    /* Metadata related to currently live objects. The live_objs list contains
-     * live entries with non-0 cookie members, potentially interspersed with
-     * dead entries with 0 cookies. The other members are used for confirming
-     * that a caller is freeing an object in the same way they allocated it.
-     */
-    struct obj {
-        seL4_Word type;
-        seL4_Word size_bits;
-        seL4_Word cookie;
-    } *live_objs;
-    size_t live_objs_sz;
+    /* Currently live objects, keyed by cookie. */
+    table_t live_objs;
 
 } state_t;
 
+static int table_init(table_t *table, size_t max)
+{
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->max = max;
+    if (max == 0) {
+        return 0;
+    }
+    size_t capacity = 2;
+    unsigned int capacity_bits = 1;
+    while (capacity < max * 2) {
+        capacity *= 2;
+        capacity_bits++;
+    }
+    table->entries = (struct entry *)calloc(capacity, sizeof(struct entry));
+    if (table->entries == NULL) {
+        return -1;
+    }
+    table->capacity = capacity;
+    table->shift = CONFIG_WORD_SIZE - capacity_bits;
+    return 0;
+}
+
+#if CONFIG_WORD_SIZE == 64
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+#else
+#define HASH_MULTIPLIER 0x9E3779B9ul
+#endif
+
+static size_t table_hash(table_t *table, seL4_Word key)
+{
+    /* Fibonacci hashing. The top bits of the product depend on every bit of the
+     * key, so aligned cookies, which share their low bits, still spread evenly.
+     */
+    return (size_t)((key * (seL4_Word)HASH_MULTIPLIER) >> table->shift);
+}
+
+/* Find the entry for a key, or the empty entry that ends its probe sequence. */
+static struct entry *table_probe(table_t *table, seL4_Word key)
+{
+    size_t i = table_hash(table, key);
+    while (table->entries[i].key != 0 && table->entries[i].key != key) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return &table->entries[i];
+}
+
+/* Remove an entry, shifting back any following entries that would no longer be
+ * reachable from their hash over the hole it leaves.
+ */
+static void table_remove(table_t *table, struct entry *e)
+{
+    size_t mask = table->capacity - 1;
+    size_t i = e - table->entries;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (table->entries[j].key == 0) {
+            break;
+        }
+        size_t k = table_hash(table, table->entries[j].key);
+        /* Entry j can fill the hole at i if its home k is not cyclically in (i, j]. */
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            table->entries[i] = table->entries[j];
+            i = j;
+        }
+    }
+    table->entries[i].key = 0;
+    table->count--;
+}
+
 /* This is called when we encounter an allocator/caller error. */
 #define fatal(args...) do { \
         fprintf(stderr, "VKA debug: " args); \
@@ -68,12 +155,21 @@ typedef struct {
         fprintf(stderr, "\n"); \
     } while (0)
 
+/* The return address of the allocation function this is used in, recorded for
+ * leak reports if call sites are enabled.
+ */
+#ifdef CONFIG_LIB_SEL4_VKA_DEBUG_CALL_SITES
+#define CALL_SITE() __builtin_extract_return_addr(__builtin_return_address(0))
+#else
+#define CALL_SITE() NULL
+#endif
+
 /* Track a slot that has just become live. */
-static void track_slot(state_t *state, seL4_CPtr slot)
+static void track_slot(state_t *state, seL4_CPtr slot, void *site)
 {
     assert(state != NULL);
 
-    if (state->live_slots_sz == 0) {
+    if (state->live_slots.max == 0) {
         /* Disable tracking if we have no buffer. */
         return;
     }
@@ -82,26 +178,22 @@ static void track_slot(state_t *state, seL4_CPtr slot)
         fatal("allocator attempted to hand out the null slot");
     }
 
-    /* Search the current list of live slots for this slot in case it's
-     * currently live. Pretty slow to do this on every allocate, but we're
-     * debugging so hey.
-     */
-    unsigned int available = 0;
-    for (unsigned int i = 0; i < state->live_slots_sz; i++) {
-        if (state->live_slots[i] == slot) {
-            fatal("allocator attempted to hand out slot %lu that is currently "
-                  "in use", (long)slot);
-        } else if (available == i && state->live_slots[i] != 0) {
-            available++;
-        }
+    /* Check whether this slot is currently live. */
+    struct entry *e = table_probe(&state->live_slots, slot);
+    if (e->key == slot) {
+        fatal("allocator attempted to hand out slot %lu that is currently "
+              "in use", (long)slot);
     }
 
-    if (available == state->live_slots_sz) {
+    if (state->live_slots.count == state->live_slots.max) {
         /* The entire live slot list is full. */
         warn("ran out of space for tracking slots; disabling tracking");
-        state->live_slots_sz = 0;
+        state->live_slots.max = 0;
     } else {
-        state->live_slots[available] = slot;
+        *e = (struct entry) {
+            .key = slot, .site = site
+        };
+        state->live_slots.count++;
     }
 }
 
@@ -113,7 +205,7 @@ static int cspace_alloc(void *data, seL4_CPtr *res)
     vka_t *v = s->underlying;
     int result = v->cspace_alloc(v->data, res);
     if (result == 0 && res != NULL) {
-        track_slot(s, *res);
+        track_slot(s, *res, CALL_SITE());
     }
     return result;
 }
@@ -123,14 +215,15 @@ static void untrack_slot(state_t *state, seL4_CPtr slot)
 {
     assert(state != NULL);
 
-    for (unsigned int i = 0; i < state->live_slots_sz; i++) {
-        if (state->live_slots[i] == slot) {
-            /* Found it. */
-            state->live_slots[i] = 0;
-            return;
-        }
+    if (state->live_slots.max == 0) {
+        return;
     }
-    fatal("attempt to free slot %lu that was not live (double free?)", (long)slot);
+
+    struct entry *e = table_probe(&state->live_slots, slot);
+    if (e->key != slot) {
+        fatal("attempt to free slot %lu that was not live (double free?)", (long)slot);
+    }
+    table_remove(&state->live_slots, e);
 }
 
 static void cspace_free(void *data, seL4_CPtr slot)
@@ -166,11 +259,11 @@ static void cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
  * track_slot. Refer to the comments in it for explanations.
  */
 static void track_obj(state_t *state, seL4_Word type, seL4_Word size_bits,
-                      seL4_Word cookie)
+                      seL4_Word cookie, void *site)
 {
     assert(state != NULL);
 
-    if (state->live_objs_sz == 0) {
+    if (state->live_objs.max == 0) {
         return;
     }
 
@@ -178,23 +271,20 @@ static void track_obj(state_t *state, seL4_Word type, seL4_Word size_bits,
         fatal("allocator attempted to hand out an object with no cookie");
     }
 
-    unsigned int available = 0;
-    for (unsigned int i = 0; i < state->live_objs_sz; i++) {
-        if (state->live_objs[i].cookie == cookie) {
-            fatal("allocator attempted to hand out an object with a cookie %zu "
-                  "that is currently in use", cookie);
-        } else if (available == i && state->live_objs[i].cookie != 0) {
-            available++;
-        }
+    struct entry *e = table_probe(&state->live_objs, cookie);
+    if (e->key == cookie) {
+        fatal("allocator attempted to hand out an object with a cookie %zu "
+              "that is currently in use", cookie);
     }
 
-    if (available == state->live_objs_sz) {
+    if (state->live_objs.count == state->live_objs.max) {
         warn("ran out of space for tracking objects; disabling tracking");
-        state->live_objs_sz = 0;
+        state->live_objs.max = 0;
     } else {
-        state->live_objs[available].type = type;
-        state->live_objs[available].size_bits = size_bits;
-        state->live_objs[available].cookie = cookie;
+        *e = (struct entry) {
+            .key = cookie, .type = type, .size_bits = size_bits, .site = site
+        };
+        state->live_objs.count++;
     }
 }
 
@@ -214,7 +304,7 @@ static int utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type,
     vka_t *v = s->underlying;
     int result = v->utspace_alloc(v->data, dest, type, size_bits, res);
     if (result == 0 && res != NULL) {
-        track_obj(s, type, size_bits, *res);
+        track_obj(s, type, size_bits, *res, CALL_SITE());
     }
     return result;
 }
@@ -229,7 +319,7 @@ static int utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4
     vka_t *v = s->underlying;
     int result = v->utspace_alloc_maybe_device(v->data, dest, type, size_bits, can_use_dev, res);
     if (result == 0 && res != NULL) {
-        track_obj(s, type, size_bits, *res);
+        track_obj(s, type, size_bits, *res, CALL_SITE());
     }
     return result;
 }
@@ -250,7 +340,7 @@ static int utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type
     vka_t *v = s->underlying;
     int result = v->utspace_alloc_at(v->data, dest, type, size_bits, paddr, cookie);
     if (result == 0 && cookie != NULL) {
-        track_obj(s, type, size_bits, *cookie);
+        track_obj(s, type, size_bits, *cookie, CALL_SITE());
     }
     return result;
 }
@@ -261,22 +351,24 @@ static void untrack_obj(state_t *state, seL4_Word type, seL4_Word size_bits,
 {
     assert(state != NULL);
 
-    for (unsigned int i = 0; i < state->live_objs_sz; i++) {
-        if (state->live_objs[i].cookie == cookie) {
-            if (state->live_objs[i].type != type) {
-                fatal("attempt to free object with type %d that was allocated "
-                      "with type %d", (int)type, (int)state->live_objs[i].type);
-            }
-            if (state->live_objs[i].size_bits != size_bits) {
-                fatal("attempt to free object with size %d that was allocated "
-                      "with size %d", (int)size_bits, (int)state->live_objs[i].size_bits);
-            }
-            state->live_objs[i].cookie = 0;
-            return;
-        }
+    if (state->live_objs.max == 0) {
+        return;
     }
-    fatal("attempt to free object %lu that was not live (double free?)",
-          (long)cookie);
+
+    struct entry *e = table_probe(&state->live_objs, cookie);
+    if (e->key != cookie) {
+        fatal("attempt to free object %lu that was not live (double free?)",
+              (long)cookie);
+    }
+    if (e->type != type) {
+        fatal("attempt to free object with type %d that was allocated "
+              "with type %d", (int)type, (int)e->type);
+    }
+    if (e->size_bits != size_bits) {
+        fatal("attempt to free object with size %d that was allocated "
+              "with size %d", (int)size_bits, (int)e->size_bits);
+    }
+    table_remove(&state->live_objs, e);
 }
 
 static void utspace_free(void *data, seL4_Word type, seL4_Word size_bits,
@@ -293,32 +385,72 @@ static void utspace_free(void *data, seL4_Word type, seL4_Word size_bits,
     v->utspace_free(v->data, type, size_bits, target);
 }
 
+#ifdef CONFIG_LIB_SEL4_VKA_DEBUG_CALL_SITES
+static int compare_sites(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) * (void *const *)a;
+    uintptr_t y = (uintptr_t) * (void *const *)b;
+    return (x > y) - (x < y);
+}
+#endif
+
+/* Print the live entries of a table, grouped by the call site that allocated them. */
+static void report_table(table_t *table, const char *name)
+{
+    printf("VKA debug: %zu live %s\n", table->count, name);
+#ifdef CONFIG_LIB_SEL4_VKA_DEBUG_CALL_SITES
+    if (table->count == 0) {
+        return;
+    }
+
+    void **sites = (void **)malloc(sizeof(void *) * table->count);
+    if (sites == NULL) {
+        warn("failed to allocate memory for the leak report");
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != 0) {
+            sites[n++] = table->entries[i].site;
+        }
+    }
+    qsort(sites, n, sizeof(void *), compare_sites);
+    for (size_t i = 0; i < n;) {
+        size_t run = i;
+        while (run < n && sites[run] == sites[i]) {
+            run++;
+        }
+        printf("  %zu allocated from %p\n", run - i, sites[i]);
+        i = run;
+    }
+    free(sites);
+#endif
+}
+
+void vka_debugvka_report_leaks(vka_t *vka)
+{
+    assert(vka != NULL && vka->data != NULL);
+
+    state_t *s = (state_t *)vka->data;
+    report_table(&s->live_slots, "slots");
+    report_table(&s->live_objs, "objects");
+}
+
 int vka_init_debugvka(vka_t *vka, vka_t *tracee)
 {
     assert(vka != NULL);
 
-    state_t *s = (state_t *)malloc(sizeof(state_t));
+    state_t *s = (state_t *)calloc(1, sizeof(state_t));
     if (s == NULL) {
         goto fail;
     }
     s->underlying = tracee;
-    s->live_slots = NULL;
-    s->live_objs = NULL;
-
-    s->live_slots_sz = live_slots_sz;
-    if (live_slots_sz > 0) {
-        s->live_slots = (seL4_CPtr *)malloc(sizeof(seL4_CPtr) * live_slots_sz);
-        if (s->live_slots == NULL) {
-            goto fail;
-        }
-    }
 
-    s->live_objs_sz = live_objs_sz;
-    if (live_objs_sz > 0) {
-        s->live_objs = (struct obj *)malloc(sizeof(struct obj) * live_objs_sz);
-        if (s->live_objs == NULL) {
-            goto fail;
-        }
+    if (table_init(&s->live_slots, live_slots_sz) != 0) {
+        goto fail;
+    }
+    if (table_init(&s->live_objs, live_objs_sz) != 0) {
+        goto fail;
     }
 
     vka->data = (void *)s;
@@ -334,12 +466,8 @@ int vka_init_debugvka(vka_t *vka, vka_t *tracee)
 
 fail:
     if (s != NULL) {
-        if (s->live_slots != NULL) {
-            free(s->live_slots);
-        }
-        if (s->live_objs != NULL) {
-            free(s->live_objs);
-        }
+        free(s->live_slots.entries);
+        free(s->live_objs.entries);
         free(s);
     }
     return -1;